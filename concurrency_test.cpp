@@ -0,0 +1,174 @@
+// Smoke test for the concurrent and snapshot paths: ConcurrentServe, ServeSnapshot and
+// ShardedServe. Exits non-zero on the first failure.
+//
+//   g++ -std=c++17 -O1 -g -fsanitize=address,undefined concurrency_test.cpp -o concurrency_test -pthread
+//
+// ConcurrentServe readers validate racy reads with seqlock versions, which ThreadSanitizer
+// reports by design; run the other sections under -fsanitize=thread with SKIP_SEQLOCK=1.
+#include "serve.hpp"
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <map>
+
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            std::exit(1);                                                            \
+        }                                                                            \
+    } while (0)
+
+static const int WRITERS = 4;
+static const int READERS = 2;
+static const int OPS = 60000;
+
+// Every writer owns the keys congruent to its id modulo WRITERS (offset past the seeded
+// multiples of 10), so its own view of them is exact while the others run.
+static int writerKey(std::mt19937& rng, int w) { return (int)(rng() % 400000) * 10 * WRITERS + 10 * w + 5; }
+
+// Writers on disjoint keys race readers of the seeded keys, which must always be found.
+static void testConcurrentServe() {
+    ConcurrentServe<int> s;
+    std::vector<int> seed;
+    for (int i = 0; i < 200000; ++i) seed.push_back(i * 10);
+    s.build(seed);
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    for (int w = 0; w < WRITERS; ++w)
+        threads.emplace_back([&, w] {
+            std::mt19937 rng(w);
+            std::set<int> mine;
+            for (int i = 0; i < OPS; ++i) {
+                int k = writerKey(rng, w);
+                if (i % 3) { s.insert(k); mine.insert(k); }
+                else CHECK(s.erase(k) == (mine.erase(k) == 1));
+                if (i % 1000 == 0) CHECK(s.query(k) == (mine.count(k) == 1));
+            }
+            for (int k : mine) CHECK(s.query(k));
+        });
+    for (int r = 0; r < READERS; ++r)
+        threads.emplace_back([&, r] {
+            std::mt19937 rng(100 + r);
+            while (!stop.load()) {
+                int k = (int)(rng() % 200000) * 10;
+                CHECK(s.query(k));  // seeded keys are never erased
+                std::vector<int> range = s.rangeQuery(k, k + 5000);
+                CHECK(std::is_sorted(range.begin(), range.end()));
+                CHECK(!range.empty() && range.front() == k);
+            }
+        });
+    for (int w = 0; w < WRITERS; ++w) threads[w].join();
+    stop = true;
+    for (size_t i = WRITERS; i < threads.size(); ++i) threads[i].join();
+
+    ServeSnapshot<int> snap = s.snapshot();
+    CHECK(snap.getTotalElements() == s.getTotalElements());
+    for (int i = 0; i < 200000; i += 97) CHECK(snap.query(i * 10));
+}
+
+// A snapshot stays readable, from other threads too, while its index is rewritten and after it is gone.
+static void testSnapshots() {
+    ServeSnapshot<int, std::string> snap;
+    std::map<int, std::string> ref;
+    {
+        ServeMap<int, std::string> m;
+        for (int i = 0; i < 50000; ++i) { m.insert_or_assign(i * 2, std::to_string(i)); ref[i * 2] = std::to_string(i); }
+        snap = m.snapshot();
+
+        // Const lookups on the index itself are read-only even while its blocks are shared,
+        // so they may run concurrently (ThreadSanitizer checks they never unshare).
+        const ServeMap<int, std::string>& view = m;
+        std::vector<std::thread> lookups;
+        for (int r = 0; r < READERS; ++r)
+            lookups.emplace_back([&, r] {
+                for (int i = r; i < 50000; i += 5) CHECK(*view.find(i * 2) == ref.at(i * 2));
+            });
+        for (auto& t : lookups) t.join();
+
+        // Readers of the snapshot run while the index is rewritten underneath it.
+        std::vector<std::thread> readers;
+        for (int r = 0; r < READERS; ++r)
+            readers.emplace_back([&] {
+                for (int i = 0; i < 50000; i += 7) {
+                    const std::string* v = snap.find(i * 2);
+                    CHECK(v && *v == ref.at(i * 2));
+                }
+            });
+        for (int i = 0; i < 50000; ++i) m.insert_or_assign(i * 2, "changed");
+        for (int i = 0; i < 20000; ++i) m.erase(i * 4);
+        m.erase_range(60000, 80000);
+        for (auto& t : readers) t.join();
+        CHECK(*m.find(2) == "changed" && m.find(0) == nullptr);
+    }
+    // The index is gone; the snapshot still owns the state it was taken from.
+    CHECK(snap.getTotalElements() == ref.size());
+    size_t seen = 0;
+    snap.for_each_in_range(0, 100000, [&](int k, const std::string& v) { CHECK(ref.at(k) == v); ++seen; });
+    CHECK(seen == ref.size());
+}
+
+// Concurrent writers grow a ShardedServe from empty while a reader scans across shards.
+static void testShardedServe() {
+    ShardedServe<int> s(4);  // grown from empty: balancing has to spread the keys
+    std::vector<std::thread> threads;
+    std::vector<std::set<int>> owned(WRITERS);
+    for (int w = 0; w < WRITERS; ++w)
+        threads.emplace_back([&, w] {
+            std::mt19937 rng(w);
+            for (int i = 0; i < OPS; ++i) {
+                int k = writerKey(rng, w);
+                if (i % 4) { s.insert(k); owned[w].insert(k); }
+                else CHECK(s.erase(k) == (owned[w].erase(k) == 1));
+            }
+        });
+    threads.emplace_back([&] {
+        for (int i = 0; i < 200; ++i) {
+            std::vector<int> range = s.rangeQuery(0, 1 << 30);
+            CHECK(std::is_sorted(range.begin(), range.end()));
+        }
+    });
+    for (auto& t : threads) t.join();
+
+    std::set<int> all;
+    for (auto& o : owned) all.insert(o.begin(), o.end());
+    CHECK(s.getTotalElements() == all.size());
+    CHECK(s.rangeQuery(INT32_MIN, INT32_MAX) == std::vector<int>(all.begin(), all.end()));
+    s.rebalance();
+    CHECK(s.count(INT32_MIN, INT32_MAX) == all.size());
+    for (int k : all) CHECK(s.query(k));
+}
+
+// Appends past the last shard's bound: balancing steps must move blocks towards the other
+// shards as it grows, keeping every shard near the mean without a whole-index re-cut.
+static void testShardAppends() {
+    const int SHARDS = 4, BUILT = 400000, APPENDED = 400000;
+    ShardedServe<int> s(SHARDS);
+    std::vector<int> data;
+    for (int i = 0; i < BUILT; ++i) data.push_back(i * 2);
+    s.build(data);
+    std::thread reader([&] {
+        for (int i = 0; i < 2000; ++i) CHECK(s.query((i * 397) % BUILT * 2));
+    });
+    for (int i = 0; i < APPENDED; ++i) s.insert(2 * BUILT + i);
+    reader.join();
+
+    std::vector<size_t> perShard(SHARDS);
+    for (int i = 0; i < BUILT; ++i) ++perShard[s.shardOf(i * 2)];
+    for (int i = 0; i < APPENDED; ++i) ++perShard[s.shardOf(2 * BUILT + i)];
+    size_t mean = (BUILT + APPENDED) / SHARDS;
+    for (size_t n : perShard) CHECK(n < 2 * mean);
+    CHECK(s.count(INT32_MIN, INT32_MAX) == (size_t)(BUILT + APPENDED));
+    for (int i = 0; i < APPENDED; i += 13) CHECK(s.query(2 * BUILT + i));
+    CHECK(s.rangeQuery(BUILT, 2 * BUILT + 999).size() == (size_t)(BUILT / 2 + 1000));
+}
+
+int main() {
+    if (!std::getenv("SKIP_SEQLOCK")) testConcurrentServe();
+    testSnapshots();
+    testShardedServe();
+    testShardAppends();
+    std::cout << "concurrency_test: ok" << std::endl;
+    return 0;
+}
@@ -4,184 +4,3490 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
-#include <immintrin.h>
 #include <utility>
 #include <iterator>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <thread>
+#include <string>
+#include <cstdio>
+#include <queue>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <filesystem>
+
+#if __cplusplus >= 202002L && __has_include(<span>) && __has_include(<ranges>)
+#include <span>
+#include <ranges>
+#define SERVE_HAS_SPAN 1
+#else
+#define SERVE_HAS_SPAN 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SERVE_HAS_MMAP 1
+#else
+#define SERVE_HAS_MMAP 0
+#endif
+
+#if defined(__GNUC__)
+#define SERVE_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define SERVE_PREFETCH(p) ((void)0)
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SERVE_X86_DISPATCH 1
+#else
+#define SERVE_X86_DISPATCH 0
+#endif
 
 /**
  * SERVE: SIMD-Enhanced Range & Value Engine
  * A hardware-aware, self-balancing search structure.
+ *
+ * Keys may be any 32/64-bit integer type or float/double (NaN keys are not supported).
  */
 
 constexpr int TARGET_BLOCK_SIZE = 4096;
 constexpr int MAX_BLOCK_SIZE = 8192;
 constexpr int MERGE_THRESHOLD = TARGET_BLOCK_SIZE / 2;
 
-struct alignas(64) Block {
-    int minVal = 0;
-    int maxVal = 0;
-    std::vector<int> data;
+/**
+ * Runtime-dispatched search kernels.
+ *
+ * One binary carries AVX-512, AVX2, SSE4.2 and scalar implementations of the in-block
+ * kernels; SearchKernels<Key>::active() picks the best one for the host CPU once, on first
+ * use. Setting SERVE_SIMD=scalar|sse4.2|avx2|avx512 in the environment caps the choice.
+ */
+enum class SimdLevel { Scalar = 0, SSE42 = 1, AVX2 = 2, AVX512 = 3 };
 
-    Block() { data.reserve(MAX_BLOCK_SIZE); }
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512: return "AVX-512";
+        case SimdLevel::AVX2: return "AVX2";
+        case SimdLevel::SSE42: return "SSE4.2";
+        default: return "Scalar";
+    }
+}
 
-    inline bool contains(int x) const {
-        return !data.empty() && x >= minVal && x <= maxVal;
+inline SimdLevel detectSimdLevel() {
+    SimdLevel level = SimdLevel::Scalar;
+#if SERVE_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) level = SimdLevel::SSE42;
+    if (level == SimdLevel::SSE42 && __builtin_cpu_supports("avx2")) level = SimdLevel::AVX2;
+    if (level == SimdLevel::AVX2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")) level = SimdLevel::AVX512;
+#endif
+    if (const char* cap = std::getenv("SERVE_SIMD")) {
+        SimdLevel limit = level;
+        if (!std::strcmp(cap, "scalar")) limit = SimdLevel::Scalar;
+        else if (!std::strcmp(cap, "sse4.2")) limit = SimdLevel::SSE42;
+        else if (!std::strcmp(cap, "avx2")) limit = SimdLevel::AVX2;
+        else if (!std::strcmp(cap, "avx512")) limit = SimdLevel::AVX512;
+        level = std::min(level, limit);
     }
+    return level;
+}
 
-    inline bool search(int x) const {
-        if (data.empty()) return false;
-        size_t low = 0, high = data.size() - 1;
+#if SERVE_X86_DISPATCH
+#define SERVE_TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+#define SERVE_TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#define SERVE_TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,avx2,popcnt")))
+// The generic kernel bodies below carry no target; flatten inlines them (and the ops they
+// call) into each ISA entry point so they are compiled for that entry point's target.
+#define SERVE_FLATTEN __attribute__((flatten))
 
-        // Stage 1: Interpolation
-        for (int steps = 0; steps < 3; ++steps) {
-            if (low > high) return false;
-            if (data[low] == x || data[high] == x) return true;
-            double pos = low + ((double)(x - data[low]) / (data[high] - data[low])) * (high - low);
-            size_t mid = std::clamp((size_t)pos, low + 1, high - 1);
-            if (data[mid] == x) return true;
-            if (data[mid] < x) low = mid + 1;
-            else high = mid - 1;
-        }
-
-        // Stage 2: SIMD (Safe Unaligned Load)
-        #ifdef __AVX2__
-        __m256i target_vec = _mm256_set1_epi32(x);
-        while (high - low > 32) {
-            size_t mid = low + (high - low) / 2;
-            __m256i vals = _mm256_loadu_si256((__m256i*)(data.data() + mid));
-            __m256i cmp = _mm256_cmpgt_epi32(target_vec, vals);
-            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(cmp));
-            if (mask == 0xFF) low = mid + 8;
-            else high = mid + 8;
-        }
-        #endif
-
-        // Stage 3: Scalar Fallback
-        while (low <= high) {
-            size_t mid = low + (high - low) / 2;
-            if (data[mid] == x) return true;
-            if (data[mid] < x) low = mid + 1;
-            else high = mid - 1;
-        }
-        return false;
+/**
+ * Per-ISA compare ops, selected by (key size, signedness, floating point).
+ * lessMask(p, x) loads `lanes` keys from p and sets bit i when p[i] < x;
+ * lessEqMask sets it when p[i] <= x.
+ */
+template <size_t Size, bool Signed, bool Floating> struct Sse42KeyOps;
+template <size_t Size, bool Signed, bool Floating> struct Avx2KeyOps;
+template <size_t Size, bool Signed, bool Floating> struct Avx512KeyOps;
+
+template <>
+struct Sse42KeyOps<4, true, false> {
+    static constexpr int lanes = 4;
+    SERVE_TARGET_SSE42 static inline int lessMask(const void* p, int32_t x) {
+        __m128i vals = _mm_loadu_si128((const __m128i*)p);
+        return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(x), vals)));
     }
+    SERVE_TARGET_SSE42 static inline int lessEqMask(const void* p, int32_t x) {
+        __m128i vals = _mm_loadu_si128((const __m128i*)p);
+        return ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vals, _mm_set1_epi32(x)))) & 0xF;
+    }
+};
 
-    inline void insert(int x) {
-        auto it = std::lower_bound(data.begin(), data.end(), x);
-        if (it != data.end() && *it == x) return;
-        data.insert(it, x);
-        minVal = data.front();
-        maxVal = data.back();
+// Unsigned keys: flip the sign bit so the signed compare orders them correctly.
+template <>
+struct Sse42KeyOps<4, false, false> {
+    static constexpr int lanes = 4;
+    SERVE_TARGET_SSE42 static inline int lessMask(const void* p, uint32_t x) {
+        __m128i bias = _mm_set1_epi32((int32_t)0x80000000u);
+        __m128i vals = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), bias);
+        return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_xor_si128(_mm_set1_epi32((int32_t)x), bias), vals)));
     }
+    SERVE_TARGET_SSE42 static inline int lessEqMask(const void* p, uint32_t x) {
+        __m128i bias = _mm_set1_epi32((int32_t)0x80000000u);
+        __m128i vals = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), bias);
+        return ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vals, _mm_xor_si128(_mm_set1_epi32((int32_t)x), bias)))) & 0xF;
+    }
+};
 
-    inline bool remove(int x) {
-        auto it = std::lower_bound(data.begin(), data.end(), x);
-        if (it == data.end() || *it != x) return false;
-        data.erase(it);
-        if (!data.empty()) {
-            minVal = data.front();
-            maxVal = data.back();
+template <>
+struct Sse42KeyOps<8, true, false> {
+    static constexpr int lanes = 2;
+    SERVE_TARGET_SSE42 static inline int lessMask(const void* p, int64_t x) {
+        __m128i vals = _mm_loadu_si128((const __m128i*)p);
+        return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_set1_epi64x(x), vals)));
+    }
+    SERVE_TARGET_SSE42 static inline int lessEqMask(const void* p, int64_t x) {
+        __m128i vals = _mm_loadu_si128((const __m128i*)p);
+        return ~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(vals, _mm_set1_epi64x(x)))) & 0x3;
+    }
+};
+
+template <>
+struct Sse42KeyOps<8, false, false> {
+    static constexpr int lanes = 2;
+    SERVE_TARGET_SSE42 static inline int lessMask(const void* p, uint64_t x) {
+        __m128i bias = _mm_set1_epi64x((int64_t)0x8000000000000000ull);
+        __m128i vals = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), bias);
+        return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_xor_si128(_mm_set1_epi64x((int64_t)x), bias), vals)));
+    }
+    SERVE_TARGET_SSE42 static inline int lessEqMask(const void* p, uint64_t x) {
+        __m128i bias = _mm_set1_epi64x((int64_t)0x8000000000000000ull);
+        __m128i vals = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), bias);
+        return ~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(vals, _mm_xor_si128(_mm_set1_epi64x((int64_t)x), bias)))) & 0x3;
+    }
+};
+
+// Floating point keys: ordered, non-signalling compares (NaN lanes compare false).
+template <>
+struct Sse42KeyOps<4, true, true> {
+    static constexpr int lanes = 4;
+    SERVE_TARGET_SSE42 static inline int lessMask(const void* p, float x) {
+        return _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps((const float*)p), _mm_set1_ps(x)));
+    }
+    SERVE_TARGET_SSE42 static inline int lessEqMask(const void* p, float x) {
+        return _mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps((const float*)p), _mm_set1_ps(x)));
+    }
+};
+
+template <>
+struct Sse42KeyOps<8, true, true> {
+    static constexpr int lanes = 2;
+    SERVE_TARGET_SSE42 static inline int lessMask(const void* p, double x) {
+        return _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd((const double*)p), _mm_set1_pd(x)));
+    }
+    SERVE_TARGET_SSE42 static inline int lessEqMask(const void* p, double x) {
+        return _mm_movemask_pd(_mm_cmple_pd(_mm_loadu_pd((const double*)p), _mm_set1_pd(x)));
+    }
+};
+
+template <>
+struct Avx2KeyOps<4, true, false> {
+    static constexpr int lanes = 8;
+    SERVE_TARGET_AVX2 static inline int lessMask(const void* p, int32_t x) {
+        __m256i vals = _mm256_loadu_si256((const __m256i*)p);
+        return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(x), vals)));
+    }
+    SERVE_TARGET_AVX2 static inline int lessEqMask(const void* p, int32_t x) {
+        __m256i vals = _mm256_loadu_si256((const __m256i*)p);
+        return ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(vals, _mm256_set1_epi32(x)))) & 0xFF;
+    }
+};
+
+template <>
+struct Avx2KeyOps<4, false, false> {
+    static constexpr int lanes = 8;
+    SERVE_TARGET_AVX2 static inline int lessMask(const void* p, uint32_t x) {
+        __m256i bias = _mm256_set1_epi32((int32_t)0x80000000u);
+        __m256i vals = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), bias);
+        return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_set1_epi32((int32_t)x), bias), vals)));
+    }
+    SERVE_TARGET_AVX2 static inline int lessEqMask(const void* p, uint32_t x) {
+        __m256i bias = _mm256_set1_epi32((int32_t)0x80000000u);
+        __m256i vals = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), bias);
+        return ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(vals, _mm256_xor_si256(_mm256_set1_epi32((int32_t)x), bias)))) & 0xFF;
+    }
+};
+
+template <>
+struct Avx2KeyOps<8, true, false> {
+    static constexpr int lanes = 4;
+    SERVE_TARGET_AVX2 static inline int lessMask(const void* p, int64_t x) {
+        __m256i vals = _mm256_loadu_si256((const __m256i*)p);
+        return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_set1_epi64x(x), vals)));
+    }
+    SERVE_TARGET_AVX2 static inline int lessEqMask(const void* p, int64_t x) {
+        __m256i vals = _mm256_loadu_si256((const __m256i*)p);
+        return ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(vals, _mm256_set1_epi64x(x)))) & 0xF;
+    }
+};
+
+template <>
+struct Avx2KeyOps<8, false, false> {
+    static constexpr int lanes = 4;
+    SERVE_TARGET_AVX2 static inline int lessMask(const void* p, uint64_t x) {
+        __m256i bias = _mm256_set1_epi64x((int64_t)0x8000000000000000ull);
+        __m256i vals = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), bias);
+        return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_xor_si256(_mm256_set1_epi64x((int64_t)x), bias), vals)));
+    }
+    SERVE_TARGET_AVX2 static inline int lessEqMask(const void* p, uint64_t x) {
+        __m256i bias = _mm256_set1_epi64x((int64_t)0x8000000000000000ull);
+        __m256i vals = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), bias);
+        return ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(vals, _mm256_xor_si256(_mm256_set1_epi64x((int64_t)x), bias)))) & 0xF;
+    }
+};
+
+template <>
+struct Avx2KeyOps<4, true, true> {
+    static constexpr int lanes = 8;
+    SERVE_TARGET_AVX2 static inline int lessMask(const void* p, float x) {
+        return _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps((const float*)p), _mm256_set1_ps(x), _CMP_LT_OQ));
+    }
+    SERVE_TARGET_AVX2 static inline int lessEqMask(const void* p, float x) {
+        return _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps((const float*)p), _mm256_set1_ps(x), _CMP_LE_OQ));
+    }
+};
+
+template <>
+struct Avx2KeyOps<8, true, true> {
+    static constexpr int lanes = 4;
+    SERVE_TARGET_AVX2 static inline int lessMask(const void* p, double x) {
+        return _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd((const double*)p), _mm256_set1_pd(x), _CMP_LT_OQ));
+    }
+    SERVE_TARGET_AVX2 static inline int lessEqMask(const void* p, double x) {
+        return _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd((const double*)p), _mm256_set1_pd(x), _CMP_LE_OQ));
+    }
+};
+
+// AVX-512 compares write straight into mask registers and order unsigned keys natively.
+template <>
+struct Avx512KeyOps<4, true, false> {
+    static constexpr int lanes = 16;
+    SERVE_TARGET_AVX512 static inline int lessMask(const void* p, int32_t x) {
+        return _mm512_cmplt_epi32_mask(_mm512_loadu_si512(p), _mm512_set1_epi32(x));
+    }
+    SERVE_TARGET_AVX512 static inline int lessEqMask(const void* p, int32_t x) {
+        return _mm512_cmple_epi32_mask(_mm512_loadu_si512(p), _mm512_set1_epi32(x));
+    }
+};
+
+template <>
+struct Avx512KeyOps<4, false, false> {
+    static constexpr int lanes = 16;
+    SERVE_TARGET_AVX512 static inline int lessMask(const void* p, uint32_t x) {
+        return _mm512_cmplt_epu32_mask(_mm512_loadu_si512(p), _mm512_set1_epi32((int32_t)x));
+    }
+    SERVE_TARGET_AVX512 static inline int lessEqMask(const void* p, uint32_t x) {
+        return _mm512_cmple_epu32_mask(_mm512_loadu_si512(p), _mm512_set1_epi32((int32_t)x));
+    }
+};
+
+template <>
+struct Avx512KeyOps<8, true, false> {
+    static constexpr int lanes = 8;
+    SERVE_TARGET_AVX512 static inline int lessMask(const void* p, int64_t x) {
+        return _mm512_cmplt_epi64_mask(_mm512_loadu_si512(p), _mm512_set1_epi64(x));
+    }
+    SERVE_TARGET_AVX512 static inline int lessEqMask(const void* p, int64_t x) {
+        return _mm512_cmple_epi64_mask(_mm512_loadu_si512(p), _mm512_set1_epi64(x));
+    }
+};
+
+template <>
+struct Avx512KeyOps<8, false, false> {
+    static constexpr int lanes = 8;
+    SERVE_TARGET_AVX512 static inline int lessMask(const void* p, uint64_t x) {
+        return _mm512_cmplt_epu64_mask(_mm512_loadu_si512(p), _mm512_set1_epi64((int64_t)x));
+    }
+    SERVE_TARGET_AVX512 static inline int lessEqMask(const void* p, uint64_t x) {
+        return _mm512_cmple_epu64_mask(_mm512_loadu_si512(p), _mm512_set1_epi64((int64_t)x));
+    }
+};
+
+template <>
+struct Avx512KeyOps<4, true, true> {
+    static constexpr int lanes = 16;
+    SERVE_TARGET_AVX512 static inline int lessMask(const void* p, float x) {
+        return _mm512_cmp_ps_mask(_mm512_loadu_ps(p), _mm512_set1_ps(x), _CMP_LT_OQ);
+    }
+    SERVE_TARGET_AVX512 static inline int lessEqMask(const void* p, float x) {
+        return _mm512_cmp_ps_mask(_mm512_loadu_ps(p), _mm512_set1_ps(x), _CMP_LE_OQ);
+    }
+};
+
+template <>
+struct Avx512KeyOps<8, true, true> {
+    static constexpr int lanes = 8;
+    SERVE_TARGET_AVX512 static inline int lessMask(const void* p, double x) {
+        return _mm512_cmp_pd_mask(_mm512_loadu_pd(p), _mm512_set1_pd(x), _CMP_LT_OQ);
+    }
+    SERVE_TARGET_AVX512 static inline int lessEqMask(const void* p, double x) {
+        return _mm512_cmp_pd_mask(_mm512_loadu_pd(p), _mm512_set1_pd(x), _CMP_LE_OQ);
+    }
+};
+
+template <template <size_t, bool, bool> class Ops, typename Key>
+using KeyOpsFor = Ops<sizeof(Key), std::is_signed<Key>::value, std::is_floating_point<Key>::value>;
+
+// Number of keys in p[0, n) that are < x (or <= x with OrEqual): one popcnt per vector.
+// A ragged tail is covered by one more vector ending exactly at p[n - 1], with the lanes
+// already counted shifted out of its mask, so no load strays past the window. Only
+// windows shorter than a single vector fall back to scalar compares.
+template <typename Ops, bool OrEqual, typename Key>
+inline size_t simdCount(const Key* p, size_t n, Key x) {
+    auto mask = [x](const Key* at) { return OrEqual ? Ops::lessEqMask(at, x) : Ops::lessMask(at, x); };
+    size_t count = 0, i = 0;
+    for (; i + Ops::lanes <= n; i += Ops::lanes) count += __builtin_popcount(mask(p + i));
+    if (i == n) return count;
+    if (n >= (size_t)Ops::lanes) return count + __builtin_popcount((unsigned)mask(p + n - Ops::lanes) >> (i + Ops::lanes - n));
+    for (; i < n; ++i) count += OrEqual ? p[i] <= x : p[i] < x;
+    return count;
+}
+
+/**
+ * Sorted-window boundary, the one search every operation goes through. The halving loop
+ * is branchless (the step compiles to a cmov, so nothing is mispredicted) and prefetches
+ * the midpoints of both possible next windows, overlapping the next probe's cache miss
+ * with this one. Once the window is at most two vectors wide, two full-width compares and
+ * their popcounts give the exact position.
+ */
+template <typename Ops, bool OrEqual, typename Key>
+inline size_t simdBound(const Key* p, size_t n, Key x) {
+    const Key* base = p;
+    while (n > 2 * Ops::lanes) {
+        size_t half = n / 2;
+        SERVE_PREFETCH(base + half / 2);
+        SERVE_PREFETCH(base + half + half / 2);
+        bool right = OrEqual ? base[half - 1] <= x : base[half - 1] < x;
+        base = right ? base + half : base;
+        n -= half;
+    }
+    return (base - p) + simdCount<Ops, OrEqual>(base, n, x);
+}
+
+template <typename Key> SERVE_TARGET_SSE42 SERVE_FLATTEN size_t sse42LowerBound(const Key* p, size_t n, Key x) { return simdBound<KeyOpsFor<Sse42KeyOps, Key>, false>(p, n, x); }
+template <typename Key> SERVE_TARGET_SSE42 SERVE_FLATTEN size_t sse42UpperBound(const Key* p, size_t n, Key x) { return simdBound<KeyOpsFor<Sse42KeyOps, Key>, true>(p, n, x); }
+template <typename Key> SERVE_TARGET_SSE42 SERVE_FLATTEN size_t sse42CountLess(const Key* p, size_t n, Key x) { return simdCount<KeyOpsFor<Sse42KeyOps, Key>, false>(p, n, x); }
+
+template <typename Key> SERVE_TARGET_AVX2 SERVE_FLATTEN size_t avx2LowerBound(const Key* p, size_t n, Key x) { return simdBound<KeyOpsFor<Avx2KeyOps, Key>, false>(p, n, x); }
+template <typename Key> SERVE_TARGET_AVX2 SERVE_FLATTEN size_t avx2UpperBound(const Key* p, size_t n, Key x) { return simdBound<KeyOpsFor<Avx2KeyOps, Key>, true>(p, n, x); }
+template <typename Key> SERVE_TARGET_AVX2 SERVE_FLATTEN size_t avx2CountLess(const Key* p, size_t n, Key x) { return simdCount<KeyOpsFor<Avx2KeyOps, Key>, false>(p, n, x); }
+
+template <typename Key> SERVE_TARGET_AVX512 SERVE_FLATTEN size_t avx512LowerBound(const Key* p, size_t n, Key x) { return simdBound<KeyOpsFor<Avx512KeyOps, Key>, false>(p, n, x); }
+template <typename Key> SERVE_TARGET_AVX512 SERVE_FLATTEN size_t avx512UpperBound(const Key* p, size_t n, Key x) { return simdBound<KeyOpsFor<Avx512KeyOps, Key>, true>(p, n, x); }
+template <typename Key> SERVE_TARGET_AVX512 SERVE_FLATTEN size_t avx512CountLess(const Key* p, size_t n, Key x) { return simdCount<KeyOpsFor<Avx512KeyOps, Key>, false>(p, n, x); }
+#endif
+
+// Same branchless, prefetching halving as simdBound, carried down to a single key.
+template <bool OrEqual, typename Key>
+inline size_t scalarBound(const Key* p, size_t n, Key x) {
+    if (n == 0) return 0;
+    const Key* base = p;
+    while (n > 1) {
+        size_t half = n / 2;
+        SERVE_PREFETCH(base + half / 2);
+        SERVE_PREFETCH(base + half + half / 2);
+        bool right = OrEqual ? base[half - 1] <= x : base[half - 1] < x;
+        base = right ? base + half : base;
+        n -= half;
+    }
+    return (base - p) + (OrEqual ? *base <= x : *base < x);
+}
+template <typename Key>
+size_t scalarLowerBound(const Key* p, size_t n, Key x) { return scalarBound<false>(p, n, x); }
+template <typename Key>
+size_t scalarUpperBound(const Key* p, size_t n, Key x) { return scalarBound<true>(p, n, x); }
+template <typename Key>
+size_t scalarCountLess(const Key* p, size_t n, Key x) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) count += p[i] < x;
+    return count;
+}
+
+// Grows [from, to) to at least width keys inside [0, n). A lower bound known to lie in the
+// window is unchanged by searching a wider one, and full vectors keep the SIMD finish of
+// short windows (model error windows, ragged tree leaves) off its scalar fallback.
+inline void widenWindow(size_t& from, size_t& to, size_t n, size_t width) {
+    if (to - from >= width) return;
+    if (n <= width) { from = 0; to = n; return; }
+    to = std::min(n, from + width);
+    from = to - width;
+}
+
+/**
+ * Function table for one key type. All kernels work on a sorted window p[0, n):
+ *   lowerBound - first index with p[i] >= x
+ *   upperBound - first index with p[i] > x
+ *   countLess  - number of keys < x (linear scan, no ordering assumed)
+ */
+template <typename Key>
+struct SearchKernels {
+    size_t (*lowerBound)(const Key*, size_t, Key);
+    size_t (*upperBound)(const Key*, size_t, Key);
+    size_t (*countLess)(const Key*, size_t, Key);
+    SimdLevel level;
+
+    static SearchKernels forLevel(SimdLevel level) {
+        switch (level) {
+#if SERVE_X86_DISPATCH
+            case SimdLevel::AVX512: return {avx512LowerBound<Key>, avx512UpperBound<Key>, avx512CountLess<Key>, level};
+            case SimdLevel::AVX2: return {avx2LowerBound<Key>, avx2UpperBound<Key>, avx2CountLess<Key>, level};
+            case SimdLevel::SSE42: return {sse42LowerBound<Key>, sse42UpperBound<Key>, sse42CountLess<Key>, level};
+#endif
+            default: return {scalarLowerBound<Key>, scalarUpperBound<Key>, scalarCountLess<Key>, SimdLevel::Scalar};
         }
-        return true;
     }
 
-    inline int size() const { return data.size(); }
+    // Resolved once per key type, on first use.
+    static const SearchKernels& active() {
+        static const SearchKernels kernels = forLevel(detectSimdLevel());
+        return kernels;
+    }
 };
 
-class UltimateHybridSearch {
+/**
+ * Pooled slab allocator for block storage.
+ *
+ * Slabs come in power-of-two size classes (64 B and up), are 64-byte aligned and are
+ * carved out of 1 MiB chunks, so building a large set costs a handful of mallocs instead
+ * of one per block. Released slabs go onto a per-class free list and are reused by the
+ * next split or merge; memory goes back to the system when the arena is destroyed.
+ * allocate() and release() are serialized by a mutex, because slabs pinned by a snapshot
+ * are released by whichever thread drops the snapshot last.
+ */
+class BlockArena {
+public:
+    static constexpr size_t kAlign = 64;
+    static constexpr size_t kChunkBytes = size_t(1) << 20;
+
+    BlockArena() = default;
+    BlockArena(const BlockArena&) = delete;
+    BlockArena& operator=(const BlockArena&) = delete;
+
+    ~BlockArena() {
+        for (void* chunk : chunks) ::operator delete(chunk, std::align_val_t(kAlign));
+    }
+
+    // Size of the slab that allocate(bytes) hands out.
+    static size_t slabSize(size_t bytes) { return size_t(1) << sizeClass(bytes); }
+
+    void* allocate(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int cls = sizeClass(bytes);
+        if (void* slab = freeLists[cls]) {
+            freeLists[cls] = *static_cast<void**>(slab);
+            return slab;
+        }
+        size_t size = size_t(1) << cls;
+        if (size > kChunkBytes / 4) return newChunk(size);
+        if (remaining < size) {
+            recycleTail();
+            cursor = static_cast<char*>(newChunk(kChunkBytes));
+            remaining = kChunkBytes;
+        }
+        void* slab = cursor;
+        cursor += size;
+        remaining -= size;
+        return slab;
+    }
+
+    // `bytes` must be the size that was passed to allocate().
+    void release(void* slab, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pushFree(slab, bytes);
+    }
+
+    size_t bytesReserved() const { return reserved; }
+
 private:
-    std::vector<Block> blocks;
+    static constexpr int kMinClass = 6;  // 64 B
+    static constexpr int kClasses = 64;
+
+    static int sizeClass(size_t bytes) {
+        int cls = kMinClass;
+        while ((size_t(1) << cls) < bytes) ++cls;
+        return cls;
+    }
+
+    void pushFree(void* slab, size_t bytes) {
+        int cls = sizeClass(bytes);
+        *static_cast<void**>(slab) = freeLists[cls];
+        freeLists[cls] = slab;
+    }
+
+    void* newChunk(size_t size) {
+        void* chunk = ::operator new(size, std::align_val_t(kAlign));
+        chunks.push_back(chunk);
+        reserved += size;
+        return chunk;
+    }
+
+    // Splits the unused tail of the current chunk into free slabs instead of dropping it.
+    void recycleTail() {
+        while (remaining >= (size_t(1) << kMinClass)) {
+            int cls = kMinClass;
+            while ((size_t(2) << cls) <= remaining) ++cls;
+            pushFree(cursor, size_t(1) << cls);
+            cursor += size_t(1) << cls;
+            remaining -= size_t(1) << cls;
+        }
+    }
+
+    std::mutex mutex;
+    void* freeLists[kClasses] = {};
+    std::vector<void*> chunks;
+    char* cursor = nullptr;
+    size_t remaining = 0;
+    size_t reserved = 0;
+};
+
+/**
+ * Growable array whose storage is a slab from a BlockArena. Capacity doubles as elements
+ * arrive, so a block's footprint tracks its element count, and the first element always
+ * sits on a 64-byte boundary.
+ *
+ * An array may instead borrow storage it does not own (see borrow()); it then edits that
+ * storage in place and moves into an arena slab the first time it has to grow. share()
+ * turns an owned slab into such borrowed storage held by a lease, for snapshots.
+ */
+template <typename T>
+class SlabArray {
+public:
+    explicit SlabArray(BlockArena* arena = nullptr) : pool(arena) {}
+    SlabArray(const SlabArray&) = delete;
+    SlabArray& operator=(const SlabArray&) = delete;
+
+    SlabArray(SlabArray&& other) noexcept
+        : pool(other.pool), ptr(other.ptr), count(other.count), cap(other.cap), owned(other.owned) {
+        other.ptr = nullptr; other.count = other.cap = 0;
+    }
+
+    SlabArray& operator=(SlabArray&& other) noexcept {
+        if (this != &other) {
+            reset();
+            pool = other.pool; ptr = other.ptr; count = other.count; cap = other.cap; owned = other.owned;
+            other.ptr = nullptr; other.count = other.cap = 0;
+        }
+        return *this;
+    }
+
+    // Uses n elements at p as contents without copying; p must outlive this array.
+    void borrow(T* p, size_t n) {
+        static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable elements can be borrowed");
+        reset();
+        ptr = p;
+        count = cap = (uint32_t)n;
+        owned = false;
+    }
+
+    inline bool ownsStorage() const { return owned; }
+
+    // Hands the slab to the returned lease, which destroys the elements and releases the
+    // slab when its last copy drops; the array keeps reading it as borrowed storage and
+    // must be made owned again (makeOwned) before the next write.
+    std::shared_ptr<void> share(std::shared_ptr<BlockArena> keepAlive) {
+        if (!owned || !ptr) return nullptr;
+        owned = false;
+        size_t n = count, bytes = slabBytes();
+        return std::shared_ptr<void>(ptr, [arena = std::move(keepAlive), n, bytes](void* slab) {
+            destroy(static_cast<T*>(slab), static_cast<T*>(slab) + n);
+            arena->release(slab, bytes);
+        });
+    }
+
+    // Copies borrowed contents into a slab of its own; the borrowed storage is left as is.
+    void makeOwned() {
+        if (owned) return;
+        T* fresh = nullptr;
+        size_t bytes = 0;
+        if (count) {
+            bytes = BlockArena::slabSize(count * sizeof(T));
+            fresh = static_cast<T*>(pool->allocate(bytes));
+            std::uninitialized_copy(ptr, ptr + count, fresh);
+        }
+        ptr = fresh;
+        cap = (uint32_t)(bytes / sizeof(T));
+        owned = true;
+    }
+
+    ~SlabArray() { reset(); }
 
-    inline int findBlockContaining(int x) const {
-        if (blocks.empty()) return -1;
-        int left = 0, right = blocks.size() - 1, result = -1;
-        while (left <= right) {
-            int mid = left + (right - left) / 2;
-            if (blocks[mid].maxVal < x) left = mid + 1;
-            else {
-                if (blocks[mid].contains(x)) result = mid;
-                right = mid - 1;
+    inline size_t size() const { return count; }
+    inline size_t capacity() const { return cap; }
+    inline bool empty() const { return count == 0; }
+    inline T* data() { return ptr; }
+    inline const T* data() const { return ptr; }
+    inline T* begin() { return ptr; }
+    inline T* end() { return ptr + count; }
+    inline const T* begin() const { return ptr; }
+    inline const T* end() const { return ptr + count; }
+    inline T& operator[](size_t i) { return ptr[i]; }
+    inline const T& operator[](size_t i) const { return ptr[i]; }
+    inline T& front() { return ptr[0]; }
+    inline const T& front() const { return ptr[0]; }
+    inline T& back() { return ptr[count - 1]; }
+    inline const T& back() const { return ptr[count - 1]; }
+    inline BlockArena* arena() const { return pool; }
+
+    void reserve(size_t n) {
+        if (n <= cap) return;
+        size_t bytes = BlockArena::slabSize(n * sizeof(T));
+        T* fresh = static_cast<T*>(pool->allocate(bytes));
+        relocate(ptr, ptr + count, fresh);
+        if (ptr && owned) pool->release(ptr, slabBytes());
+        ptr = fresh;
+        cap = (uint32_t)(bytes / sizeof(T));
+        owned = true;
+    }
+
+    void insert(size_t pos, T value) {
+        if (count == cap) reserve(count + 1);
+        if constexpr (std::is_trivially_copyable<T>::value) {
+            std::memmove((void*)(ptr + pos + 1), (const void*)(ptr + pos), (count - pos) * sizeof(T));
+            ptr[pos] = value;
+        } else {
+            if (pos == count) {
+                new (ptr + count) T(std::move(value));
+            } else {
+                new (ptr + count) T(std::move(ptr[count - 1]));
+                std::move_backward(ptr + pos, ptr + count - 1, ptr + count);
+                ptr[pos] = std::move(value);
             }
         }
-        return result;
+        ++count;
     }
 
-    void splitBlockIfNeeded(int idx) {
-        if (idx < 0 || idx >= (int)blocks.size() || blocks[idx].size() <= MAX_BLOCK_SIZE) return;
-        Block& b = blocks[idx];
-        int mid = b.size() / 2;
-        Block right;
-        right.data.assign(b.data.begin() + mid, b.data.end());
-        b.data.resize(mid);
-        b.minVal = b.data.front(); b.maxVal = b.data.back();
-        right.minVal = right.data.front(); right.maxVal = right.data.back();
-        blocks.insert(blocks.begin() + idx + 1, std::move(right));
+    void push_back(T value) { insert(count, std::move(value)); }
+
+    // Removes [from, to).
+    void erase(size_t from, size_t to) {
+        if (from >= to) return;
+        std::move(ptr + to, ptr + count, ptr + from);
+        destroy(ptr + count - (to - from), ptr + count);
+        count -= (uint32_t)(to - from);
     }
 
-    void mergeBlocksIfNeeded(int idx) {
-        if (idx < 0 || idx >= (int)blocks.size() - 1) return;
-        if (blocks[idx].size() + blocks[idx+1].size() < TARGET_BLOCK_SIZE) {
-            blocks[idx].data.insert(blocks[idx].data.end(), std::make_move_iterator(blocks[idx+1].data.begin()), std::make_move_iterator(blocks[idx+1].data.end()));
-            blocks[idx].minVal = blocks[idx].data.front();
-            blocks[idx].maxVal = blocks[idx].data.back();
-            blocks.erase(blocks.begin() + idx + 1);
+    void erase(size_t pos) { erase(pos, pos + 1); }
+
+    // Shrinks to n elements, or grows with value-initialized ones.
+    void resize(size_t n) {
+        if (n < count) { destroy(ptr + n, ptr + count); count = (uint32_t)n; return; }
+        reserve(n);
+        for (; count < n; ++count) new (ptr + count) T();
+    }
+
+    // Appends [first, last); with move iterators the source elements are moved from.
+    template <typename It>
+    void append(It first, It last) {
+        size_t n = std::distance(first, last);
+        reserve(count + n);
+        if constexpr (std::is_trivially_copyable<T>::value && std::is_pointer<It>::value) {
+            if (n) std::memcpy((void*)(ptr + count), (const void*)first, n * sizeof(T));
+        } else {
+            std::uninitialized_copy(first, last, ptr + count);
         }
+        count += (uint32_t)n;
     }
 
-public:
-    UltimateHybridSearch() { blocks.reserve(512); }
+    template <typename It>
+    void assign(It first, It last) {
+        clear();
+        append(first, last);
+    }
 
-    void build(std::vector<int>& data) {
-        blocks.clear();
-        if (data.empty()) return;
-        std::sort(data.begin(), data.end());
-        data.erase(std::unique(data.begin(), data.end()), data.end());
-        for (size_t i = 0; i < data.size(); i += TARGET_BLOCK_SIZE) {
-            size_t end = std::min(i + (size_t)TARGET_BLOCK_SIZE, data.size());
-            Block b;
-            b.data.assign(data.begin() + i, data.begin() + end);
-            b.minVal = b.data.front(); b.maxVal = b.data.back();
-            blocks.push_back(std::move(b));
+    void clear() { destroy(ptr, ptr + count); count = 0; }
+
+private:
+    size_t slabBytes() const { return BlockArena::slabSize(cap * sizeof(T)); }
+
+    static void destroy(T* first, T* last) {
+        if constexpr (!std::is_trivially_destructible<T>::value) for (; first != last; ++first) first->~T();
+    }
+
+    static void relocate(T* first, T* last, T* out) {
+        if constexpr (std::is_trivially_copyable<T>::value) {
+            if (first != last) std::memcpy((void*)out, (const void*)first, (last - first) * sizeof(T));
+        } else {
+            std::uninitialized_move(first, last, out);
+            destroy(first, last);
         }
     }
 
-    bool query(int x) const {
-        int idx = findBlockContaining(x);
-        return idx >= 0 && blocks[idx].search(x);
+    void reset() {
+        if (!ptr) return;
+        if (owned) {
+            destroy(ptr, ptr + count);
+            pool->release(ptr, slabBytes());
+        }
+        ptr = nullptr; count = cap = 0;
+        owned = true;
     }
 
-    void insert(int x) {
-        if (blocks.empty()) {
-            Block b; b.insert(x);
-            blocks.push_back(std::move(b));
-            return;
+    BlockArena* pool = nullptr;
+    T* ptr = nullptr;
+    uint32_t count = 0;
+    uint32_t cap = 0;
+    bool owned = true;
+};
+
+// Payload column of a map-mode Block; set-mode blocks (Value = void) carry none.
+struct EmptyPayload {};
+
+template <typename Value>
+struct PayloadColumn { using type = SlabArray<Value>; };
+
+template <>
+struct PayloadColumn<void> { using type = EmptyPayload; };
+
+// In-block layout: plain sorted keys, or sorted keys plus a static B+tree index (BlockTree)
+// or a fitted linear model (LinearModel, with a PiecewiseLinearModel over the directory).
+enum class BlockLayout { Sorted, STree, Learned };
+
+/**
+ * How Block::locate resolved a lookup. Sorted blocks pick one of the first three when they
+ * are (re)classified, from how far straight-line interpolation strays on a sample of keys;
+ * STree and Learned blocks always use their index.
+ *
+ * Building with -DSERVE_PATH_COUNTERS=1 counts every lookup per path (a relaxed atomic
+ * increment, so it is off by default); searchPathCount() reads the totals.
+ */
+enum class SearchPath : uint8_t { Interpolation, LinearScan, BinarySearch, STree, Model };
+constexpr int SEARCH_PATH_COUNT = 5;
+
+inline const char* searchPathName(SearchPath path) {
+    switch (path) {
+        case SearchPath::Interpolation: return "interpolation";
+        case SearchPath::LinearScan: return "linear-scan";
+        case SearchPath::BinarySearch: return "binary-search";
+        case SearchPath::STree: return "s-tree";
+        default: return "model";
+    }
+}
+
+#ifndef SERVE_PATH_COUNTERS
+#define SERVE_PATH_COUNTERS 0
+#endif
+
+inline std::atomic<uint64_t>* searchPathCounters() {
+    static std::atomic<uint64_t> counters[SEARCH_PATH_COUNT] = {};
+    return counters;
+}
+
+inline uint64_t searchPathCount(SearchPath path) { return searchPathCounters()[(int)path].load(std::memory_order_relaxed); }
+
+inline void resetSearchPathCounts() {
+    for (int i = 0; i < SEARCH_PATH_COUNT; ++i) searchPathCounters()[i].store(0, std::memory_order_relaxed);
+}
+
+#if SERVE_PATH_COUNTERS
+#define SERVE_COUNT_PATH(path) searchPathCounters()[(int)(path)].fetch_add(1, std::memory_order_relaxed)
+#else
+#define SERVE_COUNT_PATH(path) ((void)0)
+#endif
+
+/**
+ * Static B+tree ("S+tree") over a block's sorted keys for read-mostly workloads.
+ *
+ * Leaves are the block's own keys taken in cache-line chunks of NODE keys; every inner
+ * node is one cache line holding the last key of each of its NODE children, padded with
+ * the largest Key value. A lookup reads one node per level (3-4 levels for a full block),
+ * each resolved by a single SIMD rank, instead of the ~12 dependent probes of a binary
+ * search. The keys stay sorted, so range scans are unaffected; the index costs about
+ * 1/NODE of the block size and is dropped on every write until rebuilt.
+ */
+template <typename Key>
+struct BlockTree {
+    static constexpr size_t NODE = 64 / sizeof(Key);
+    static constexpr int MAX_LEVELS = 8;
+
+    SlabArray<Key> nodes;
+    uint32_t levelStart[MAX_LEVELS] = {};  // root level first
+    uint8_t levels = 0;
+    bool valid = false;
+
+    explicit BlockTree(BlockArena* arena) : nodes(arena) {}
+
+    static constexpr Key padKey() {
+        return std::numeric_limits<Key>::has_infinity ? std::numeric_limits<Key>::infinity()
+                                                      : std::numeric_limits<Key>::max();
+    }
+
+    void build(const Key* keys, size_t n) {
+        nodes.clear();
+        levels = 0;
+        valid = false;
+        if (n <= NODE) return;
+        // Level sizes bottom-up, in separators: one per leaf chunk, then one per child node.
+        size_t sizes[MAX_LEVELS];
+        int count = 0;
+        for (size_t children = (n + NODE - 1) / NODE; count < MAX_LEVELS; ) {
+            sizes[count++] = children;
+            if (children <= NODE) break;
+            children = (children + NODE - 1) / NODE;
         }
-        auto it = std::upper_bound(blocks.begin(), blocks.end(), x, [](int v, const Block& b){ return v < b.minVal; });
-        int idx = (it == blocks.begin()) ? 0 : std::distance(blocks.begin(), --it);
-        blocks[idx].insert(x);
-        splitBlockIfNeeded(idx);
+        if (sizes[count - 1] > NODE) return;
+        size_t total = 0, start[MAX_LEVELS];
+        for (int l = count - 1; l >= 0; --l) {
+            start[l] = total;
+            total += (sizes[l] + NODE - 1) / NODE * NODE;
+        }
+        nodes.resize(total);
+        // Bottom level: last key of each leaf chunk; higher levels: last key of each node below.
+        for (size_t c = 0; c < sizes[0]; ++c) nodes[start[0] + c] = keys[std::min(n, (c + 1) * NODE) - 1];
+        for (int l = 1; l < count; ++l)
+            for (size_t c = 0; c < sizes[l]; ++c)
+                nodes[start[l] + c] = nodes[start[l - 1] + std::min(sizes[l - 1], (c + 1) * NODE) - 1];
+        for (int l = 0; l < count; ++l)
+            for (size_t c = sizes[l]; c % NODE; ++c) nodes[start[l] + c] = padKey();
+        for (int l = 0; l < count; ++l) levelStart[l] = (uint32_t)start[count - 1 - l];
+        levels = (uint8_t)count;
+        valid = true;
     }
 
-    std::vector<int> rangeQuery(int low, int high) const {
-        std::vector<int> res;
-        auto it = std::lower_bound(blocks.begin(), blocks.end(), low, [](const Block& b, int v){ return b.maxVal < v; });
-        for (; it != blocks.end() && it->minVal <= high; ++it) {
-            auto start = std::lower_bound(it->data.begin(), it->data.end(), low);
-            auto end = std::upper_bound(start, it->data.end(), high);
-            res.insert(res.end(), start, end);
+    // Index of the first key >= x (n when every key is smaller).
+    inline size_t lowerBound(const Key* keys, size_t n, Key x, const SearchKernels<Key>& k) const {
+        // Past the last key the descent would land in padding; below it, every node on the
+        // path holds a real separator >= x, so the padded slots are never chosen.
+        if (!(x <= keys[n - 1])) return n;
+        size_t node = 0;
+        for (int l = 0; l < levels; ++l) {
+            const Key* sep = nodes.data() + levelStart[l] + node * NODE;
+            if (l + 1 < levels) SERVE_PREFETCH(nodes.data() + levelStart[l + 1] + node * NODE * NODE);
+            node = node * NODE + k.countLess(sep, NODE, x);
         }
-        return res;
+        size_t base = node * NODE;
+        size_t end = std::min(n, base + NODE);
+        widenWindow(base, end, n, NODE);
+        return base + k.countLess(keys + base, end - base, x);
     }
+};
 
-    void printStats() const {
-        std::cout << "Blocks: " << blocks.size() << " | Elements: " << getTotalElements() << std::endl;
+/**
+ * Least-squares line from key to position over a sorted run, plus the largest distance
+ * between a predicted and a true position. The prediction is monotone in the key, so the
+ * lower bound of any x lies within maxError + 1 slots of predict(x) and a lookup is one
+ * multiply-add followed by a kernel search over that window. Fits well on clustered or
+ * near-uniform data (timestamps, ids); on skewed data the window simply grows.
+ */
+template <typename Key>
+struct LinearModel {
+    Key origin = Key();
+    double slope = 0, intercept = 0;
+    uint32_t maxError = 0;
+    bool valid = false;
+
+    inline size_t predict(Key x, size_t n) const {
+        double p = slope * ((double)x - (double)origin) + intercept;
+        if (!(p > 0)) return 0;
+        return p >= (double)(n - 1) ? n - 1 : (size_t)p;
     }
 
-    size_t getTotalElements() const {
-        size_t total = 0;
-        for (const auto& b : blocks) total += b.size();
-        return total;
+    void fit(const Key* keys, size_t n) {
+        valid = false;
+        if (n == 0) return;
+        origin = keys[0];
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        for (size_t i = 0; i < n; ++i) {
+            double x = (double)keys[i] - (double)origin, y = (double)i;
+            sx += x; sy += y; sxx += x * x; sxy += x * y;
+        }
+        double denom = n * sxx - sx * sx;
+        slope = denom > 0 ? std::max(0.0, (n * sxy - sx * sy) / denom) : 0.0;
+        intercept = (sy - slope * sx) / n;
+        size_t err = 0;
+        for (size_t i = 0; i < n; ++i) {
+            size_t p = predict(keys[i], n);
+            err = std::max(err, p > i ? p - i : i - p);
+        }
+        maxError = (uint32_t)err;
+        valid = true;
+    }
+
+    // Index of the first key >= x (n when every key is smaller).
+    inline size_t lowerBound(const Key* keys, size_t n, Key x, const SearchKernels<Key>& k) const {
+        size_t p = predict(x, n);
+        size_t from = p > maxError ? p - maxError - 1 : 0;
+        size_t to = std::min(n, p + maxError + 2);
+        widenWindow(from, to, n, 64 / sizeof(Key));
+        return from + k.lowerBound(keys + from, to - from, x);
+    }
+};
+
+/**
+ * PGM-style model over the fence directory: fences are cut greedily into segments that a
+ * line predicts within EPSILON positions (shrinking-cone fit), and the segment of a key is
+ * found by a kernel search over the segment start keys. One level suffices here because a
+ * directory has a few thousand fences, which fit in a handful of segments.
+ */
+template <typename Key>
+struct PiecewiseLinearModel {
+    static constexpr size_t EPSILON = 64 / sizeof(Key) / 2;
+
+    SlabArray<Key> segmentKeys;
+    std::vector<std::pair<double, uint32_t>> segments;  // (slope, first fence)
+    uint32_t maxError = 0;
+    bool valid = false;
+
+    explicit PiecewiseLinearModel(BlockArena* arena) : segmentKeys(arena) {}
+
+    void fit(const Key* keys, size_t n) {
+        segmentKeys.clear();
+        segments.clear();
+        valid = false;
+        if (n == 0) return;
+        for (size_t start = 0; start < n; ) {
+            double lo = 0, hi = std::numeric_limits<double>::infinity();
+            size_t end = start + 1;
+            for (; end < n; ++end) {
+                double dx = (double)keys[end] - (double)keys[start], dy = (double)(end - start);
+                if (!(dx > 0)) {
+                    if (dy > EPSILON) break;
+                    continue;
+                }
+                double l = std::max(lo, (dy - EPSILON) / dx), h = std::min(hi, (dy + EPSILON) / dx);
+                if (l > h) break;
+                lo = l; hi = h;
+            }
+            segmentKeys.push_back(keys[start]);
+            segments.push_back({hi == std::numeric_limits<double>::infinity() ? lo : (lo + hi) / 2, (uint32_t)start});
+            start = end;
+        }
+        size_t err = 0;
+        for (size_t s = 0; s < segments.size(); ++s) {
+            size_t first = segments[s].second, last = s + 1 < segments.size() ? segments[s + 1].second : n;
+            for (size_t i = first; i < last; ++i) {
+                size_t p = predict(s, keys[i], n);
+                err = std::max(err, p > i ? p - i : i - p);
+            }
+        }
+        maxError = (uint32_t)err;
+        valid = true;
+    }
+
+    inline size_t predict(size_t s, Key x, size_t n) const {
+        size_t first = segments[s].second, last = (s + 1 < segments.size() ? segments[s + 1].second : n) - 1;
+        double p = segments[s].first * ((double)x - (double)segmentKeys[s]);
+        if (!(p > 0)) return first;
+        return p >= (double)(last - first) ? last : first + (size_t)p;
+    }
+
+    // Index of the first key >= x (n when every key is smaller).
+    inline size_t lowerBound(const Key* keys, size_t n, Key x, const SearchKernels<Key>& k) const {
+        size_t s = k.upperBound(segmentKeys.data(), segmentKeys.size(), x);
+        if (s == 0) return 0;
+        --s;
+        // The answer lies in [first, last]: keys[first] <= x < the next segment's first key.
+        size_t first = segments[s].second, last = s + 1 < segments.size() ? segments[s + 1].second : n;
+        size_t p = predict(s, x, n);
+        size_t from = std::max(first, p > maxError ? p - maxError - 1 : 0);
+        size_t to = std::min(last, p + maxError + 2);
+        widenWindow(from, to, n, 2 * EPSILON);
+        return from + k.lowerBound(keys + from, to - from, x);
     }
 };
 
+template <typename Key, typename Value = void>
+struct alignas(64) Block {
+    static_assert(std::is_arithmetic<Key>::value && (sizeof(Key) == 4 || sizeof(Key) == 8),
+                  "SERVE keys must be 32/64-bit integers, float or double");
+    static constexpr bool hasPayload = !std::is_void<Value>::value;
+    static constexpr size_t npos = (size_t)-1;
+    // Sorted blocks this small are scanned with one countLess instead of searched.
+    static constexpr size_t LINEAR_SCAN_MAX = 256 / sizeof(Key) * 4;
+
+    // Running total of the keys for range sums; integer totals wrap modulo 2^64.
+    using KeySum = std::conditional_t<std::is_floating_point<Key>::value, double, uint64_t>;
+
+    Key minVal = Key();
+    Key maxVal = Key();
+    // Sum of data, kept current by every edit so a range sum takes covered blocks whole.
+    KeySum keySum = 0;
+    // Floating-point keys only: rounding error of keySum, carried by compensated updates.
+    KeySum sumCarry = 0;
+    // Keys live in a 64-byte-aligned arena slab sized to the element count.
+    SlabArray<Key> data;
+    // Structure-of-arrays: values[i] belongs to data[i], so the key search stays dense.
+    typename PayloadColumn<Value>::type values;
+    // Read-optimized index over data (BlockLayout::STree or Learned); dropped on every write.
+    BlockTree<Key> tree;
+    LinearModel<Key> model;
+    // Search used while no index is valid; chosen by classify().
+    SearchPath path = SearchPath::Interpolation;
+    // Set while snapshots share this block's storage; the next write copies it first.
+    std::shared_ptr<void> lease;
+
+    explicit Block(BlockArena* arena) : data(arena), tree(arena) {
+        if constexpr (hasPayload) values = SlabArray<Value>(arena);
+    }
+
+    // Shares the block's storage with a snapshot: owned slabs move into a lease that keeps
+    // them (and their arena) alive, borrowed storage is pinned through its backing.
+    const std::shared_ptr<void>& pin(const std::shared_ptr<BlockArena>& arena, const std::shared_ptr<void>& backing) {
+        if (lease) return lease;
+        std::shared_ptr<void> keys = data.ownsStorage() ? data.share(arena) : backing;
+        if constexpr (hasPayload)
+            lease = std::make_shared<std::pair<std::shared_ptr<void>, std::shared_ptr<void>>>(std::move(keys), values.share(arena));
+        else
+            lease = std::move(keys);
+        return lease;
+    }
+
+    // Copy-on-write: gives the block private storage again before it is modified.
+    inline void unshare() {
+        if (!lease) return;
+        data.makeOwned();
+        if constexpr (hasPayload && std::is_copy_constructible<Value>::value) values.makeOwned();
+        lease.reset();
+    }
+
+    inline bool indexed() const { return tree.valid || model.valid; }
+    inline void dropIndex() { tree.valid = model.valid = false; }
+
+    // Picks the Sorted-layout search path: interpolation when it lands within n/64 keys of
+    // the truth on a sample of 32 keys, a plain scan for small blocks, else binary search.
+    inline void classify() {
+        size_t n = data.size();
+        if (n <= LINEAR_SCAN_MAX) { path = SearchPath::LinearScan; return; }
+        if (!(minVal < maxVal)) { path = SearchPath::BinarySearch; return; }
+        constexpr size_t SAMPLES = 32;
+        double scale = (double)(n - 1) / ((double)maxVal - (double)minVal), worst = 0;
+        if (!std::isfinite(scale) || scale == 0) { path = SearchPath::BinarySearch; return; }  // infinite or overflowing span
+        for (size_t i = 1; i < SAMPLES; ++i) {
+            size_t pos = i * (n - 1) / SAMPLES;
+            double err = ((double)data[pos] - (double)minVal) * scale - (double)pos;
+            worst = std::max(worst, err < 0 ? -err : err);
+        }
+        path = worst <= n / 64.0 ? SearchPath::Interpolation : SearchPath::BinarySearch;
+    }
+
+    // Single-key writes keep the search path, except across LINEAR_SCAN_MAX: a scanned
+    // block that outgrows the scan (or a searched one that shrinks into it) is re-sampled.
+    inline void reclassifyIfResized() {
+        if ((path == SearchPath::LinearScan) != (data.size() <= LINEAR_SCAN_MAX)) classify();
+    }
+
+    inline void rebuildIndex(BlockLayout layout) {
+        classify();
+        dropIndex();
+        if (layout == BlockLayout::STree) tree.build(data.data(), data.size());
+        else if (layout == BlockLayout::Learned) model.fit(data.data(), data.size());
+        if (layout != BlockLayout::STree && tree.nodes.capacity()) tree = BlockTree<Key>(data.arena());
+    }
+
+    // Deep copy into another arena.
+    Block cloneInto(BlockArena* arena) const {
+        Block copy(arena);
+        copy.minVal = minVal; copy.maxVal = maxVal; copy.keySum = keySum; copy.sumCarry = sumCarry;
+        copy.data.assign(data.begin(), data.end());
+        if constexpr (hasPayload) copy.values.assign(values.begin(), values.end());
+        return copy;
+    }
+
+    inline bool contains(Key x) const {
+        return !data.empty() && x >= minVal && x <= maxVal;
+    }
+
+    static KeySum sumKeys(const Key* first, const Key* last) {
+        KeySum sum = 0;
+        for (; first != last; ++first) sum += (KeySum)*first;
+        return sum;
+    }
+
+    // Sum of data[from, to); long slices are taken as the block total minus the rest.
+    KeySum sumRange(size_t from, size_t to) const {
+        if (std::is_floating_point<Key>::value || 2 * (to - from) <= data.size()) return sumKeys(data.begin() + from, data.begin() + to);
+        return keySum - sumKeys(data.begin(), data.begin() + from) - sumKeys(data.begin() + to, data.end());
+    }
+
+    // Sets minVal, maxVal and keySum after data was filled directly.
+    void summarize() {
+        minVal = data.front();
+        maxVal = data.back();
+        keySum = sumKeys(data.begin(), data.end());
+        sumCarry = 0;
+    }
+
+    // Floating-point totals are adjusted with Neumaier's compensated summation and then
+    // renormalized, so keySum stays the rounded true total however many edits pass; only an
+    // infinite key or total falls back to re-summing the block.
+    void adjustSum(KeySum added, KeySum removed) {
+        if constexpr (std::is_floating_point<Key>::value) {
+            for (KeySum x : {added, -removed}) {
+                KeySum t = keySum + x;
+                if (!std::isfinite(t)) {
+                    keySum = sumKeys(data.begin(), data.end());
+                    sumCarry = 0;
+                    return;
+                }
+                sumCarry += std::abs(keySum) >= std::abs(x) ? (keySum - t) + x : (x - t) + keySum;
+                keySum = t + sumCarry;
+                sumCarry -= keySum - t;
+            }
+        } else {
+            keySum += added - removed;
+        }
+    }
+
+    // Position of x in data, or npos when absent.
+    inline size_t locate(Key x) const {
+        size_t pos = lowerBound(x);
+        return (pos < data.size() && data[pos] == x) ? pos : npos;
+    }
+
+    // First position whose key is >= x. Lookups, writes and range bounds all search through
+    // here, so they share the block's index or search path.
+    inline size_t lowerBound(Key x) const {
+        if (data.empty()) return 0;
+        const SearchKernels<Key>& k = SearchKernels<Key>::active();
+        if (tree.valid) {
+            SERVE_COUNT_PATH(SearchPath::STree);
+            return tree.lowerBound(data.data(), data.size(), x, k);
+        }
+        if (model.valid) {
+            SERVE_COUNT_PATH(SearchPath::Model);
+            return model.lowerBound(data.data(), data.size(), x, k);
+        }
+        switch (path) {
+            case SearchPath::LinearScan:
+                SERVE_COUNT_PATH(SearchPath::LinearScan);
+                return k.countLess(data.data(), data.size(), x);
+            case SearchPath::BinarySearch:
+                SERVE_COUNT_PATH(SearchPath::BinarySearch);
+                return k.lowerBound(data.data(), data.size(), x);
+            default:
+                SERVE_COUNT_PATH(SearchPath::Interpolation);
+                return interpolate(x);
+        }
+    }
+
+    // Keys are unique, so the upper bound is the lower bound stepped past an exact match.
+    inline size_t upperBound(Key x) const {
+        size_t pos = lowerBound(x);
+        return pos + (pos < data.size() && data[pos] == x);
+    }
+
+    // Positions [start, end) of the keys within [low, high].
+    inline std::pair<size_t, size_t> rangeBounds(Key low, Key high) const {
+        size_t start = low <= minVal ? 0 : lowerBound(low);
+        size_t end = high >= maxVal ? data.size() : upperBound(high);
+        return {start, std::max(start, end)};
+    }
+
+    // The original three-stage search: interpolation, then SIMD narrowing and a final scan.
+    inline size_t interpolate(Key x) const {
+        // The answer lies in [low, high]
+        size_t low = 0, high = data.size();
+
+        // Stage 1: Interpolation (computed in double so 64-bit and float keys cannot overflow)
+        for (int steps = 0; steps < 3 && high - low > 2; ++steps) {
+            Key lo = data[low], hi = data[high - 1];
+            if (!(lo < x)) return low;
+            if (hi < x) return high;
+            double span = (double)hi - (double)lo;
+            if (!std::isfinite(span)) break;  // an infinite bound has no meaningful probe
+            double pos = low + ((double)x - (double)lo) / span * (high - 1 - low);
+            size_t mid = std::clamp((size_t)pos, low + 1, high - 2);
+            if (data[mid] == x) return mid;
+            if (data[mid] < x) low = mid + 1;
+            else high = mid;
+        }
+
+        // Stage 2 + 3: runtime-dispatched branchless narrowing and SIMD finish
+        return low + SearchKernels<Key>::active().lowerBound(data.data() + low, high - low, x);
+    }
+
+    inline bool search(Key x) const { return locate(x) != npos; }
+
+    // Interpolated guess of where x sits; used to prefetch before the real search.
+    inline const Key* guess(Key x) const {
+        if (data.size() < 2 || !(minVal < maxVal)) return data.data();
+        double frac = ((double)x - (double)minVal) / ((double)maxVal - (double)minVal);
+        if (!std::isfinite(frac)) return data.data();
+        size_t pos = (size_t)(std::clamp(frac, 0.0, 1.0) * (data.size() - 1));
+        return data.data() + pos;
+    }
+
+    // Inserts x if absent (map blocks get a value-initialized payload). Returns its position.
+    inline size_t insert(Key x, bool* inserted = nullptr) {
+        unshare();
+        size_t pos = lowerBound(x);
+        bool fresh = pos == data.size() || data[pos] != x;
+        if (fresh) {
+            dropIndex();
+            data.insert(pos, x);
+            if constexpr (hasPayload) values.insert(pos, Value());
+            minVal = data.front();
+            maxVal = data.back();
+            adjustSum((KeySum)x, 0);
+            reclassifyIfResized();
+        }
+        if (inserted) *inserted = fresh;
+        return pos;
+    }
+
+    inline bool remove(Key x) {
+        size_t pos = lowerBound(x);
+        if (pos == data.size() || data[pos] != x) return false;
+        unshare();
+        dropIndex();
+        if constexpr (hasPayload) values.erase(pos);
+        data.erase(pos);
+        adjustSum(0, (KeySum)x);
+        if (!data.empty()) {
+            minVal = data.front();
+            maxVal = data.back();
+            reclassifyIfResized();
+        }
+        return true;
+    }
+
+    // Removes elements [from, to). The block may become empty.
+    inline void eraseRange(size_t from, size_t to) {
+        unshare();
+        dropIndex();
+        KeySum removed = sumKeys(data.begin() + from, data.begin() + to);
+        data.erase(from, to);
+        adjustSum(0, removed);
+        if constexpr (hasPayload) values.erase(from, to);
+        if (!data.empty()) {
+            minVal = data.front();
+            maxVal = data.back();
+            reclassifyIfResized();
+        }
+    }
+
+    // Moves elements [from, size()) into a new block.
+    inline Block splitOff(size_t from) {
+        Block right(data.arena());
+        unshare();
+        dropIndex();
+        right.data.assign(data.begin() + from, data.end());
+        data.resize(from);
+        if constexpr (hasPayload) {
+            right.values.assign(std::make_move_iterator(values.begin() + from), std::make_move_iterator(values.end()));
+            values.resize(from);
+        }
+        right.summarize();
+        minVal = data.front(); maxVal = data.back();
+        adjustSum(0, right.keySum);
+        return right;
+    }
+
+    // Appends a block whose keys are all greater than ours.
+    inline void absorb(Block& next) {
+        unshare();
+        next.unshare();
+        dropIndex();
+        data.append(next.data.begin(), next.data.end());
+        if constexpr (hasPayload) values.append(std::make_move_iterator(next.values.begin()), std::make_move_iterator(next.values.end()));
+        minVal = data.front();
+        maxVal = data.back();
+        adjustSum(next.keySum, 0);
+        adjustSum(next.sumCarry, 0);
+        reclassifyIfResized();
+    }
+
+    inline int size() const { return data.size(); }
+};
+
+/**
+ * LSD radix sort for integer keys: 11-bit digits (3 passes for 32-bit keys, 6 for 64-bit),
+ * all digit histograms gathered in one read pass, and ping-pong scatter between data and
+ * buffer. Signed keys are ordered by flipping the sign bit. Passes whose digit is the same
+ * for every key are skipped, so narrow key ranges cost fewer passes.
+ */
+template <typename Key>
+void radixSort(Key* data, size_t n, Key* buffer) {
+    static_assert(std::is_integral<Key>::value, "radixSort needs integer keys");
+    using Bits = std::conditional_t<sizeof(Key) == 4, uint32_t, uint64_t>;
+    constexpr int DIGIT_BITS = 11;
+    constexpr int BUCKETS = 1 << DIGIT_BITS;
+    constexpr int PASSES = (int)(sizeof(Key) * 8 + DIGIT_BITS - 1) / DIGIT_BITS;
+    constexpr Bits flip = std::is_signed<Key>::value ? Bits(1) << (sizeof(Key) * 8 - 1) : 0;
+
+    std::vector<size_t> hist((size_t)PASSES * BUCKETS, 0);
+    for (size_t i = 0; i < n; ++i) {
+        Bits bits = (Bits)data[i] ^ flip;
+        for (int p = 0; p < PASSES; ++p) ++hist[p * BUCKETS + ((bits >> (p * DIGIT_BITS)) & (BUCKETS - 1))];
+    }
+
+    Key* src = data;
+    Key* dst = buffer;
+    for (int p = 0; p < PASSES; ++p) {
+        size_t* h = hist.data() + (size_t)p * BUCKETS;
+        Bits first = (((Bits)src[0] ^ flip) >> (p * DIGIT_BITS)) & (BUCKETS - 1);
+        if (h[first] == n) continue;
+        size_t sum = 0;
+        for (int b = 0; b < BUCKETS; ++b) { size_t c = h[b]; h[b] = sum; sum += c; }
+        for (size_t i = 0; i < n; ++i) {
+            Key k = src[i];
+            dst[h[(((Bits)k ^ flip) >> (p * DIGIT_BITS)) & (BUCKETS - 1)]++] = k;
+        }
+        std::swap(src, dst);
+    }
+    if (src != data) std::memcpy((void*)data, (const void*)src, n * sizeof(Key));
+}
+
+// Radix sort for integer keys from RADIX_SORT_MIN elements up, std::sort otherwise.
+constexpr size_t RADIX_SORT_MIN = size_t(1) << 14;
+
+// scratch, when given, must hold n keys; otherwise the radix path allocates its own.
+template <typename Key>
+void sortKeys(Key* first, size_t n, Key* scratch = nullptr) {
+    if constexpr (std::is_integral<Key>::value) {
+        if (n >= RADIX_SORT_MIN) {
+            std::unique_ptr<Key[]> owned(scratch ? nullptr : new Key[n]);
+            radixSort(first, n, scratch ? scratch : owned.get());
+            return;
+        }
+    }
+    std::sort(first, first + n);
+}
+
+/**
+ * Options for UltimateHybridSearch::build.
+ * threads:   worker threads for sorting, deduplication and block materialization
+ *            (1 = single-threaded, 0 = one per hardware thread).
+ * presorted: the input is already in ascending order; sorting is skipped and only the
+ *            linear duplicate-removal pass runs.
+ */
+struct BuildOptions {
+    unsigned threads = 1;
+    bool presorted = false;
+};
+
+inline unsigned resolveThreadCount(unsigned requested) {
+    if (requested) return requested;
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw ? hw : 1;
+}
+
+// Runs fn(0) .. fn(tasks - 1) on separate threads (task 0 on the caller) and joins them.
+template <typename F>
+inline void runParallel(size_t tasks, F&& fn) {
+    std::vector<std::thread> workers;
+    workers.reserve(tasks);
+    for (size_t t = 1; t < tasks; ++t) workers.emplace_back([&fn, t] { fn(t); });
+    if (tasks) fn(0);
+    for (auto& w : workers) w.join();
+}
+
+// Runs fn(0) .. fn(chunks - 1) on up to `threads` threads that claim chunks from a shared
+// counter, so a thread that draws cheap chunks keeps taking work from the others' share.
+template <typename F>
+inline void runChunks(size_t chunks, unsigned threads, F&& fn) {
+    std::atomic<size_t> next{0};
+    runParallel(std::min<size_t>(threads, chunks), [&](size_t) {
+        for (size_t c; (c = next.fetch_add(1, std::memory_order_relaxed)) < chunks;) fn(c);
+    });
+}
+
+/**
+ * Sorts and deduplicates data with `threads` workers: per-chunk sortKeys, pairwise merge
+ * rounds (each merge split across the workers by splitter keys), then a parallel
+ * compaction whose output offsets come from a prefix sum of per-chunk unique counts.
+ */
+template <typename Key>
+void parallelSortUnique(std::vector<Key>& data, unsigned threads, bool presorted = false) {
+    size_t n = data.size();
+    std::vector<size_t> bounds(threads + 1);
+    for (unsigned t = 0; t <= threads; ++t) bounds[t] = n * t / threads;
+    std::vector<Key> buffer(n);
+    if (!presorted)
+        runParallel(threads, [&](size_t t) { sortKeys(data.data() + bounds[t], bounds[t + 1] - bounds[t], buffer.data() + bounds[t]); });
+
+    Key* src = data.data();
+    Key* dst = buffer.data();
+    struct MergeTask { size_t a, aEnd, b, bEnd, out; };
+    for (size_t width = 1; width < threads && !presorted; width *= 2) {
+        std::vector<MergeTask> tasks;
+        size_t pairs = (threads + 2 * width - 1) / (2 * width);
+        size_t split = std::max<size_t>(1, threads / pairs);
+        for (size_t p = 0; p < pairs; ++p) {
+            size_t lo = bounds[p * 2 * width];
+            size_t mid = bounds[std::min<size_t>(p * 2 * width + width, threads)];
+            size_t hi = bounds[std::min<size_t>(p * 2 * width + 2 * width, threads)];
+            // Cut the left run evenly; the right run is cut where those splitter keys land.
+            size_t prevA = lo, prevB = mid;
+            for (size_t s = 1; s <= split; ++s) {
+                size_t a = s == split ? mid : lo + (mid - lo) * s / split;
+                size_t b = s == split ? hi : std::lower_bound(src + prevB, src + hi, src[a]) - src;
+                tasks.push_back({prevA, a, prevB, b, lo + (prevA - lo) + (prevB - mid)});
+                prevA = a; prevB = b;
+            }
+        }
+        runParallel(tasks.size(), [&](size_t t) {
+            const MergeTask& m = tasks[t];
+            std::merge(src + m.a, src + m.aEnd, src + m.b, src + m.bEnd, dst + m.out);
+        });
+        std::swap(src, dst);
+    }
+
+    std::vector<size_t> offsets(threads + 1, 0);
+    runParallel(threads, [&](size_t t) {
+        size_t count = 0;
+        for (size_t i = bounds[t]; i < bounds[t + 1]; ++i) count += i == 0 || src[i] != src[i - 1];
+        offsets[t + 1] = count;
+    });
+    for (unsigned t = 0; t < threads; ++t) offsets[t + 1] += offsets[t];
+    runParallel(threads, [&](size_t t) {
+        Key* out = dst + offsets[t];
+        for (size_t i = bounds[t]; i < bounds[t + 1]; ++i)
+            if (i == 0 || src[i] != src[i - 1]) *out++ = src[i];
+    });
+    if (dst != data.data()) data.swap(buffer);
+    data.resize(offsets[threads]);
+}
+
+/**
+ * On-disk index layout (native byte order), written by save() and mapped by open_mmap():
+ *   [0, 64)        IndexFileHeader
+ *   fenceOffset    blockCount fence keys (block max keys), 64-byte aligned
+ *   tableOffset    blockCount IndexFileBlock entries
+ *   entry.offset   each block's keys, contiguous and 64-byte aligned
+ */
+constexpr uint32_t INDEX_FILE_VERSION = 2;
+constexpr char INDEX_FILE_MAGIC[8] = {'S', 'E', 'R', 'V', 'E', 'I', 'D', 'X'};
+
+struct IndexFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t keySize;
+    uint32_t keyKind;  // 0 = signed integer, 1 = unsigned integer, 2 = floating point
+    uint32_t reserved;
+    uint64_t blockCount;
+    uint64_t keyCount;
+    uint64_t fenceOffset;
+    uint64_t tableOffset;
+    uint64_t fileSize;
+};
+static_assert(sizeof(IndexFileHeader) == 64, "index header must fill one cache line");
+
+struct IndexFileBlock {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t keySum;  // bit pattern of Block::keySum, so opening a file reads no keys
+};
+
+template <typename Key>
+constexpr uint32_t indexKeyKind() {
+    return std::is_floating_point<Key>::value ? 2 : std::is_signed<Key>::value ? 0 : 1;
+}
+
+template <typename Key, typename Value>
+class UltimateHybridSearch;
+
+/**
+ * Immutable point-in-time view of an UltimateHybridSearch, returned by snapshot().
+ *
+ * A snapshot references the blocks' key (and payload) slabs instead of copying them: it
+ * holds a small descriptor per block plus a lease on its storage. The index keeps using
+ * the same slabs until it next modifies a block, which then copies that block first, so
+ * taking a snapshot costs O(blocks) and each later write pays at most one block copy.
+ * Slabs are released when neither the index nor any snapshot references them, even if
+ * the index itself is gone. Snapshots may be read from any thread.
+ */
+template <typename Key, typename Value = void>
+class ServeSnapshot {
+    static constexpr bool isMap = !std::is_void<Value>::value;
+    using Payload = std::conditional_t<isMap, Value, EmptyPayload>;
+    template <typename V>
+    using EnableIfMap = std::enable_if_t<!std::is_void<V>::value, int>;
+
+    struct Part {
+        const Key* keys;
+        const Payload* values;
+        size_t count;
+    };
+
+    std::vector<Part> parts;
+    std::vector<Key> fences;  // fences[i] == last key of parts[i]
+    std::vector<std::shared_ptr<void>> pins;
+    size_t total = 0;
+
+    friend class UltimateHybridSearch<Key, Value>;
+
+    // Position of x inside part i, or npos.
+    size_t locate(size_t i, Key x) const {
+        const Part& p = parts[i];
+        if (x < p.keys[0]) return (size_t)-1;
+        size_t pos = SearchKernels<Key>::active().lowerBound(p.keys, p.count, x);
+        return (pos < p.count && p.keys[pos] == x) ? pos : (size_t)-1;
+    }
+
+    size_t firstPart(Key x) const {
+        return SearchKernels<Key>::active().lowerBound(fences.data(), fences.size(), x);
+    }
+
+public:
+    ServeSnapshot() = default;
+
+    bool query(Key x) const {
+        size_t i = firstPart(x);
+        return i < parts.size() && locate(i, x) != (size_t)-1;
+    }
+
+    std::vector<Key> rangeQuery(Key low, Key high) const {
+        std::vector<Key> res;
+        const SearchKernels<Key>& k = SearchKernels<Key>::active();
+        for (size_t i = firstPart(low); i < parts.size() && parts[i].keys[0] <= high; ++i) {
+            const Part& p = parts[i];
+            size_t start = k.lowerBound(p.keys, p.count, low);
+            size_t end = start + k.upperBound(p.keys + start, p.count - start, high);
+            res.insert(res.end(), p.keys + start, p.keys + end);
+        }
+        return res;
+    }
+
+    // Map mode: payload of key, or nullptr when absent. Valid as long as the snapshot.
+    template <typename V = Value, EnableIfMap<V> = 0>
+    const V* find(Key key) const {
+        size_t i = firstPart(key);
+        if (i == parts.size()) return nullptr;
+        size_t pos = locate(i, key);
+        return pos == (size_t)-1 ? nullptr : &parts[i].values[pos];
+    }
+
+    // Map mode: calls f(key, value) for every key in [low, high], in ascending order.
+    template <typename F, typename V = Value, EnableIfMap<V> = 0>
+    void for_each_in_range(Key low, Key high, F&& f) const {
+        const SearchKernels<Key>& k = SearchKernels<Key>::active();
+        for (size_t i = firstPart(low); i < parts.size() && parts[i].keys[0] <= high; ++i) {
+            const Part& p = parts[i];
+            size_t start = k.lowerBound(p.keys, p.count, low);
+            size_t end = start + k.upperBound(p.keys + start, p.count - start, high);
+            for (size_t j = start; j < end; ++j) f(p.keys[j], p.values[j]);
+        }
+    }
+
+    size_t getTotalElements() const { return total; }
+};
+
+// A block's contiguous run of keys inside a range, as yielded by RangeView.
+#if SERVE_HAS_SPAN
+template <typename Key>
+using KeySlice = std::span<const Key>;
+#else
+template <typename Key>
+class KeySlice {
+public:
+    KeySlice() = default;
+    KeySlice(const Key* p, size_t n) : ptr(p), count(n) {}
+
+    const Key* data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const Key* begin() const { return ptr; }
+    const Key* end() const { return ptr + count; }
+    const Key& operator[](size_t i) const { return ptr[i]; }
+
+private:
+    const Key* ptr = nullptr;
+    size_t count = 0;
+};
+#endif
+
+/**
+ * The keys of an index within [low, high], read in place: iterating the view yields one
+ * KeySlice per overlapping block, in key order, so nothing is copied or allocated. The
+ * iterators are bidirectional and do not refer to the view, only to the index. Both are
+ * invalidated by any write to the index. Under C++20 the view models std::ranges::view and
+ * borrowed_range, so it composes with std::views adaptors by value.
+ */
+template <typename Key, typename BlockType>
+class RangeView {
+public:
+    class iterator {
+    public:
+        using iterator_concept = std::bidirectional_iterator_tag;
+        using iterator_category = std::input_iterator_tag;  // yields slices by value
+        using value_type = KeySlice<Key>;
+        using difference_type = std::ptrdiff_t;
+        using reference = KeySlice<Key>;
+        using pointer = void;
+
+        iterator() = default;
+
+        KeySlice<Key> operator*() const {
+            size_t from = block == head ? headStart : 0;
+            size_t to = block == tail ? tailEnd : block->data.size();
+            return KeySlice<Key>(block->data.data() + from, to - from);
+        }
+
+        iterator& operator++() { ++block; return *this; }
+        iterator operator++(int) { iterator old = *this; ++block; return old; }
+        iterator& operator--() { --block; return *this; }
+        iterator operator--(int) { iterator old = *this; --block; return old; }
+
+        bool operator==(const iterator& other) const { return block == other.block; }
+        bool operator!=(const iterator& other) const { return block != other.block; }
+
+    private:
+        friend class RangeView;
+        iterator(const BlockType* at, const RangeView& view)
+            : block(at), head(view.head), tail(view.tail), headStart(view.headStart), tailEnd(view.tailEnd) {}
+
+        const BlockType* block = nullptr;
+        const BlockType* head = nullptr;  // first block in range; its slice starts at headStart
+        const BlockType* tail = nullptr;  // last block in range; its slice ends at tailEnd
+        size_t headStart = 0;
+        size_t tailEnd = 0;
+    };
+
+    RangeView() = default;
+
+    iterator begin() const { return iterator(head, *this); }
+    iterator end() const { return iterator(stop, *this); }
+    bool empty() const { return head == stop; }
+
+private:
+    template <typename, typename>
+    friend class UltimateHybridSearch;
+    RangeView(const BlockType* first, const BlockType* last, size_t start, size_t end)
+        : head(first), tail(last - 1), stop(last), headStart(start), tailEnd(end) {}
+
+    const BlockType* head = nullptr;
+    const BlockType* tail = nullptr;
+    const BlockType* stop = nullptr;
+    size_t headStart = 0;
+    size_t tailEnd = 0;
+};
+
+#if SERVE_HAS_SPAN
+namespace std::ranges {
+template <typename Key, typename BlockType>
+inline constexpr bool enable_view<RangeView<Key, BlockType>> = true;
+template <typename Key, typename BlockType>
+inline constexpr bool enable_borrowed_range<RangeView<Key, BlockType>> = true;
+}  // namespace std::ranges
+#endif
+
+/**
+ * Value = void gives the plain ordered set. Any other Value turns the structure
+ * into an ordered map (see ServeMap) whose payloads live beside the keys in each Block.
+ */
+template <typename Key>
+class StreamingBuilder;
+template <typename Key, typename Value>
+class ConcurrentServe;
+template <typename Key, typename Value>
+class ShardedServe;
+
+template <typename Key = int, typename Value = void>
+class UltimateHybridSearch {
+private:
+    friend class StreamingBuilder<Key>;
+    friend class ConcurrentServe<Key, Value>;
+    friend class ShardedServe<Key, Value>;
+
+    using BlockType = Block<Key, Value>;
+    static constexpr bool isMap = BlockType::hasPayload;
+    template <typename V>
+    using EnableIfMap = std::enable_if_t<!std::is_void<V>::value, int>;
+
+    // Declared before blocks so the slabs are released before the arena goes away.
+    std::shared_ptr<BlockArena> arena;
+    // External key storage that blocks (and the fences) borrow from: the vector adopted by
+    // build(std::vector<Key>&&) or the file mapped by open_mmap().
+    std::shared_ptr<void> backing;
+    std::vector<BlockType> blocks;
+
+    // Fence-key directory: fences[i] == blocks[i].maxVal, packed densely so block lookup
+    // scans a few cache lines of keys instead of striding across Block headers. For large
+    // sets, summary[g] holds the last fence of each cache-line-sized group of fences.
+    static constexpr size_t FENCE_GROUP = 64 / sizeof(Key);
+    SlabArray<Key> fences;
+    SlabArray<Key> summary;
+    BlockLayout layout = BlockLayout::Sorted;
+    // BlockLayout::Learned replaces the summary with a fitted model over the fences.
+    PiecewiseLinearModel<Key> directoryModel;
+
+    void rebuildSummary() {
+        directoryModel.valid = false;
+        if (layout == BlockLayout::Learned) directoryModel.fit(fences.data(), fences.size());
+        summary.clear();
+        if (fences.size() <= 4 * FENCE_GROUP) return;
+        summary.reserve((fences.size() + FENCE_GROUP - 1) / FENCE_GROUP);
+        for (size_t i = FENCE_GROUP - 1; i < fences.size() + FENCE_GROUP - 1; i += FENCE_GROUP)
+            summary.push_back(fences[std::min(i, fences.size() - 1)]);
+    }
+
+    // Called after every bulk change to the block list, so it also refreshes block indexes.
+    void rebuildDirectory() {
+        fences.clear();
+        fences.reserve(blocks.size());
+        for (const auto& b : blocks) fences.push_back(b.maxVal);
+        rebuildSummary();
+        refreshLayout();
+    }
+
+    // Refreshes the fence of blocks[idx] after its maxVal may have changed.
+    inline void syncFence(int idx) {
+        if (fences[idx] != blocks[idx].maxVal) directoryModel.valid = false;
+        fences[idx] = blocks[idx].maxVal;
+        size_t group = idx / FENCE_GROUP;
+        if (group < summary.size() && (idx % FENCE_GROUP == FENCE_GROUP - 1 || (size_t)idx == fences.size() - 1))
+            summary[group] = fences[idx];
+    }
+
+    // Index of the first block whose maxVal >= x (blocks.size() when there is none).
+    inline size_t directoryLowerBound(Key x) const {
+        const SearchKernels<Key>& k = SearchKernels<Key>::active();
+        size_t n = fences.size();
+        if (directoryModel.valid) return directoryModel.lowerBound(fences.data(), n, x, k);
+        if (summary.empty()) return k.lowerBound(fences.data(), n, x);
+        size_t group = k.lowerBound(summary.data(), summary.size(), x);
+        if (group == summary.size()) return n;
+        size_t base = group * FENCE_GROUP;
+        size_t end = std::min(n, base + FENCE_GROUP);
+        widenWindow(base, end, n, FENCE_GROUP);
+        return base + k.lowerBound(fences.data() + base, end - base, x);
+    }
+
+    inline int findBlockContaining(Key x) const {
+        size_t idx = directoryLowerBound(x);
+        return (idx < blocks.size() && blocks[idx].minVal <= x) ? (int)idx : -1;
+    }
+
+    // Block that should receive x: the last block whose minVal <= x (or the first block).
+    inline int findBlockForInsert(Key x) const {
+        size_t idx = directoryLowerBound(x);
+        if (idx == blocks.size()) return (int)idx - 1;
+        if (idx > 0 && x < blocks[idx].minVal) return (int)idx - 1;
+        return (int)idx;
+    }
+
+    void splitBlockIfNeeded(int idx) {
+        if (idx < 0 || idx >= (int)blocks.size() || blocks[idx].size() <= MAX_BLOCK_SIZE) {
+            if (idx >= 0 && idx < (int)blocks.size()) syncFence(idx);
+            return;
+        }
+        BlockType right = blocks[idx].splitOff(blocks[idx].size() / 2);
+        blocks.insert(blocks.begin() + idx + 1, std::move(right));
+        fences[idx] = blocks[idx].maxVal;
+        fences.insert(idx + 1, blocks[idx + 1].maxVal);
+        rebuildSummary();
+        blocks[idx].rebuildIndex(layout);
+        blocks[idx + 1].rebuildIndex(layout);
+    }
+
+    void dropBlocks(size_t from, size_t to) {
+        if (from >= to) return;
+        blocks.erase(blocks.begin() + from, blocks.begin() + to);
+        fences.erase(from, to);
+        rebuildSummary();
+    }
+
+    // Drops blocks[idx] when empty; folds it into its smaller neighbour when it has fallen
+    // below MERGE_THRESHOLD, splitting the result again if that overflows MAX_BLOCK_SIZE.
+    void mergeBlocksIfNeeded(int idx) {
+        if (idx < 0 || idx >= (int)blocks.size()) return;
+        if (blocks[idx].size() == 0) { dropBlocks(idx, idx + 1); return; }
+        syncFence(idx);
+        if (blocks[idx].size() >= MERGE_THRESHOLD || blocks.size() == 1) return;
+        int left = idx - 1, right = idx + 1;
+        bool useLeft = right >= (int)blocks.size() || (left >= 0 && blocks[left].size() <= blocks[right].size());
+        int into = useLeft ? left : idx;
+        blocks[into].absorb(blocks[into + 1]);
+        dropBlocks(into + 1, into + 2);
+        splitBlockIfNeeded(into);
+    }
+
+    template <typename BuildFn>
+    void buildBlocks(size_t n, BuildFn&& fill) {
+        for (size_t i = 0; i < n; i += TARGET_BLOCK_SIZE) {
+            size_t end = std::min(i + (size_t)TARGET_BLOCK_SIZE, n);
+            BlockType b(arena.get());
+            b.data.reserve(end - i);
+            fill(b, i, end);
+            b.summarize();
+            blocks.push_back(std::move(b));
+        }
+        rebuildDirectory();
+    }
+
+    // Merges block b with sorted, unique keys [first, last) and appends the resulting
+    // block(s) to out; the result is cut into equal pieces when it exceeds MAX_BLOCK_SIZE.
+    void mergeIntoBlocks(BlockType& b, const Key* first, const Key* last, std::vector<BlockType>& out) {
+        b.unshare();  // payloads are moved out of b
+        size_t total = b.size() + (last - first);
+        size_t pieces = total > (size_t)MAX_BLOCK_SIZE ? (total + TARGET_BLOCK_SIZE - 1) / TARGET_BLOCK_SIZE : 1;
+        size_t pieceLen = (total + pieces - 1) / pieces;
+        BlockType cur(arena.get());
+        cur.data.reserve(std::min(pieceLen, total));
+        auto emit = [&](Key key, size_t from) {
+            if (cur.data.size() == pieceLen) {
+                cur.summarize();
+                out.push_back(std::move(cur));
+                cur = BlockType(arena.get());
+                cur.data.reserve(pieceLen);
+            }
+            cur.data.push_back(key);
+            if constexpr (isMap) {
+                if (from == BlockType::npos) cur.values.push_back(Value());
+                else cur.values.push_back(std::move(b.values[from]));
+            }
+        };
+        size_t i = 0, n = b.size();
+        while (i < n || first != last) {
+            if (first == last || (i < n && b.data[i] < *first)) { emit(b.data[i], i); ++i; }
+            else if (i < n && b.data[i] == *first) { emit(b.data[i], i); ++i; ++first; }
+            else { emit(*first, BlockType::npos); ++first; }
+        }
+        cur.summarize();
+        out.push_back(std::move(cur));
+    }
+
+    // Block slabs are taken from the (single-threaded) arena up front; the copies run in parallel.
+    void buildBlocksParallel(const Key* sorted, size_t n, unsigned threads) {
+        size_t count = (n + TARGET_BLOCK_SIZE - 1) / TARGET_BLOCK_SIZE;
+        blocks.reserve(count);
+        for (size_t i = 0; i < n; i += TARGET_BLOCK_SIZE) {
+            blocks.emplace_back(arena.get());
+            size_t len = std::min((size_t)TARGET_BLOCK_SIZE, n - i);
+            blocks.back().data.reserve(len);
+            if constexpr (isMap) blocks.back().values.reserve(len);
+        }
+        size_t workers = std::max<size_t>(1, std::min<size_t>(threads, count));
+        runParallel(workers, [&](size_t t) {
+            for (size_t b = count * t / workers; b < count * (t + 1) / workers; ++b) {
+                size_t i = b * TARGET_BLOCK_SIZE, end = std::min(i + (size_t)TARGET_BLOCK_SIZE, n);
+                blocks[b].data.append(sorted + i, sorted + end);
+                if constexpr (isMap) blocks[b].values.resize(end - i);
+                blocks[b].summarize();
+            }
+        });
+        rebuildDirectory();
+    }
+
+    void clearBlocks() {
+        blocks.clear();
+        fences.clear();
+        summary.clear();
+        directoryModel.valid = false;
+        backing.reset();
+    }
+
+    // Sorts (unless presorted) and deduplicates data in place; returns the worker count used.
+    unsigned sortUnique(std::vector<Key>& data, const BuildOptions& options) {
+        // Below ~32K keys per worker the thread start-up costs more than it saves.
+        unsigned threads = (unsigned)std::min<size_t>(resolveThreadCount(options.threads), std::max<size_t>(1, data.size() >> 15));
+        if (threads > 1) {
+            parallelSortUnique(data, threads, options.presorted);
+        } else {
+            if (!options.presorted) sortKeys(data.data(), data.size());
+            data.erase(std::unique(data.begin(), data.end()), data.end());
+        }
+        return threads;
+    }
+
+    // Appends ascending keys to the tail block, opening a new block every TARGET_BLOCK_SIZE
+    // keys. Keys not greater than the current maximum are dropped. Call rebuildDirectory() after.
+    inline void appendSorted(Key x) {
+        if (!blocks.empty() && !(blocks.back().maxVal < x)) return;
+        if (blocks.empty() || blocks.back().size() == TARGET_BLOCK_SIZE) {
+            blocks.emplace_back(arena.get());
+            blocks.back().data.reserve(TARGET_BLOCK_SIZE);
+            if constexpr (isMap) blocks.back().values.reserve(TARGET_BLOCK_SIZE);
+            blocks.back().minVal = x;
+        }
+        BlockType& b = blocks.back();
+        b.data.push_back(x);
+        if constexpr (isMap) b.values.push_back(Value());
+        b.maxVal = x;
+        b.keySum += (typename BlockType::KeySum)x;
+    }
+
+public:
+    using key_type = Key;
+    using mapped_type = Value;
+    // Result of sum(); integer sums wrap modulo 2^64.
+    using sum_type = std::conditional_t<std::is_floating_point<Key>::value, double,
+                                        std::conditional_t<std::is_signed<Key>::value, int64_t, uint64_t>>;
+
+    UltimateHybridSearch()
+        : arena(std::make_shared<BlockArena>()), fences(arena.get()), summary(arena.get()), directoryModel(arena.get()) {
+        blocks.reserve(512);
+    }
+
+    UltimateHybridSearch(const UltimateHybridSearch& other) : UltimateHybridSearch() {
+        layout = other.layout;
+        for (const auto& b : other.blocks) blocks.push_back(b.cloneInto(arena.get()));
+        rebuildDirectory();
+    }
+
+    UltimateHybridSearch(UltimateHybridSearch&& other) noexcept : UltimateHybridSearch() { swap(other); }
+
+    UltimateHybridSearch& operator=(UltimateHybridSearch other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    void swap(UltimateHybridSearch& other) noexcept {
+        std::swap(arena, other.arena);
+        backing.swap(other.backing);
+        blocks.swap(other.blocks);
+        std::swap(fences, other.fences);
+        std::swap(summary, other.summary);
+        std::swap(layout, other.layout);
+        std::swap(directoryModel, other.directoryModel);
+    }
+
+    /**
+     * BlockLayout::STree gives every block a static B+tree index for faster point lookups;
+     * BlockLayout::Learned fits a linear model per block and a piecewise one over the block
+     * directory. Writes drop the index of the block they touch (that block falls back to the
+     * regular search); bulk operations and splits rebuild it, and refreshLayout() rebuilds
+     * every stale index after a burst of single-key writes.
+     */
+    void setLayout(BlockLayout l) {
+        layout = l;
+        for (auto& b : blocks) b.rebuildIndex(layout);
+        rebuildSummary();
+    }
+
+    BlockLayout getLayout() const { return layout; }
+
+    // Sorted blocks have no index, so this re-picks their search path instead (see classify).
+    void refreshLayout() {
+        for (auto& b : blocks)
+            if (!b.indexed()) b.rebuildIndex(layout);
+        if (layout == BlockLayout::Learned && !directoryModel.valid) directoryModel.fit(fences.data(), fences.size());
+    }
+
+    // Sorts and deduplicates data in place, then copies it into blocks.
+    void build(std::vector<Key>& data) { build(data, BuildOptions()); }
+
+    void build(std::vector<Key>& data, const BuildOptions& options) {
+        clearBlocks();
+        if (data.empty()) return;
+        unsigned threads = sortUnique(data, options);
+        buildBlocksParallel(data.data(), data.size(), threads);
+    }
+
+    /**
+     * Adopts data as key storage: it is sorted and deduplicated in place and the blocks
+     * borrow slices of it, so no key is copied. A block moves into the arena only when an
+     * insert makes it grow. With options.presorted this is a single dedup pass.
+     */
+    void build(std::vector<Key>&& data, const BuildOptions& options = BuildOptions()) {
+        clearBlocks();
+        if (data.empty()) return;
+        sortUnique(data, options);
+        auto adopted = std::make_shared<std::vector<Key>>(std::move(data));
+        backing = adopted;
+        const Key* keys = adopted->data();
+        size_t n = adopted->size();
+        blocks.reserve((n + TARGET_BLOCK_SIZE - 1) / TARGET_BLOCK_SIZE);
+        for (size_t i = 0; i < n; i += TARGET_BLOCK_SIZE) {
+            size_t len = std::min((size_t)TARGET_BLOCK_SIZE, n - i);
+            blocks.emplace_back(arena.get());
+            BlockType& b = blocks.back();
+            b.data.borrow(const_cast<Key*>(keys) + i, len);
+            if constexpr (isMap) b.values.resize(len);
+            b.summarize();
+        }
+        rebuildDirectory();
+    }
+
+    /**
+     * Builds from [first, last) without modifying the source. Presorted input is streamed
+     * straight into blocks in one pass; otherwise the keys are gathered once into a
+     * working vector that the blocks then adopt.
+     */
+    template <typename InputIt, typename = std::enable_if_t<!std::is_integral<InputIt>::value>>
+    void build(InputIt first, InputIt last, const BuildOptions& options = BuildOptions()) {
+        if (!options.presorted) {
+            build(std::vector<Key>(first, last), options);
+            return;
+        }
+        clearBlocks();
+        for (; first != last; ++first) appendSorted(*first);
+        rebuildDirectory();
+    }
+
+    void build(const Key* keys, size_t n, const BuildOptions& options = BuildOptions()) {
+        build(keys, keys + n, options);
+    }
+
+#if SERVE_HAS_SPAN
+    void build(std::span<const Key> keys, const BuildOptions& options = BuildOptions()) {
+        build(keys.data(), keys.data() + keys.size(), options);
+    }
+#endif
+
+    // Map mode: builds from (key, value) pairs; for duplicate keys the last pair wins.
+    template <typename V = Value, EnableIfMap<V> = 0>
+    void build(std::vector<std::pair<Key, V>>& items) {
+        clearBlocks();
+        if (items.empty()) return;
+        std::stable_sort(items.begin(), items.end(), [](const auto& a, const auto& b){ return a.first < b.first; });
+        size_t out = 0;
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (i + 1 < items.size() && items[i + 1].first == items[i].first) continue;
+            if (out != i) items[out] = std::move(items[i]);
+            ++out;
+        }
+        items.resize(out);
+        buildBlocks(items.size(), [&](BlockType& b, size_t i, size_t end) {
+            b.values.reserve(end - i);
+            for (size_t j = i; j < end; ++j) {
+                b.data.push_back(items[j].first);
+                b.values.push_back(std::move(items[j].second));
+            }
+        });
+    }
+
+    bool query(Key x) const {
+        int idx = findBlockContaining(x);
+        return idx >= 0 && blocks[idx].search(x);
+    }
+
+    static constexpr size_t QUERY_BATCH_GROUP = 16;
+
+    /**
+     * Membership test for n keys at once; out[i] = query(keys[i]). Lookups run in groups
+     * whose steps are interleaved (directory for all, prefetch, then in-block search for
+     * all), so the cache misses of independent keys overlap instead of serializing.
+     */
+    void query_batch(const Key* keys, size_t n, bool* out) const {
+        int idx[QUERY_BATCH_GROUP];
+        for (size_t base = 0; base < n; base += QUERY_BATCH_GROUP) {
+            size_t count = std::min(QUERY_BATCH_GROUP, n - base);
+            for (size_t i = 0; i < count; ++i) {
+                idx[i] = findBlockContaining(keys[base + i]);
+                if (idx[i] >= 0) SERVE_PREFETCH(&blocks[idx[i]]);
+            }
+            for (size_t i = 0; i < count; ++i)
+                if (idx[i] >= 0) SERVE_PREFETCH(blocks[idx[i]].guess(keys[base + i]));
+            for (size_t i = 0; i < count; ++i)
+                out[base + i] = idx[i] >= 0 && blocks[idx[i]].search(keys[base + i]);
+        }
+    }
+
+    /**
+     * query_batch for keys in ascending order: blocks are visited monotonically and each
+     * search starts where the previous key in the same block ended.
+     */
+    void query_batch_sorted(const Key* keys, size_t n, bool* out) const {
+        const SearchKernels<Key>& k = SearchKernels<Key>::active();
+        size_t b = 0, from = 0;
+        for (size_t i = 0; i < n; ++i) {
+            Key x = keys[i];
+            if (b < blocks.size() && fences[b] < x) {
+                // Step to the next block, or jump through the directory when x is far ahead.
+                if (b + 1 < blocks.size() && fences[b + 1] >= x) ++b;
+                else b = directoryLowerBound(x);
+                from = 0;
+            }
+            if (b == blocks.size()) { std::fill(out + i, out + n, false); return; }
+            const BlockType& blk = blocks[b];
+            if (x < blk.minVal) { out[i] = false; continue; }
+            from += k.lowerBound(blk.data.data() + from, blk.data.size() - from, x);
+            out[i] = from < blk.data.size() && blk.data[from] == x;
+        }
+    }
+
+    std::vector<bool> query_batch(const std::vector<Key>& keys) const {
+        std::unique_ptr<bool[]> found(new bool[keys.size()]);
+        query_batch(keys.data(), keys.size(), found.get());
+        return std::vector<bool>(found.get(), found.get() + keys.size());
+    }
+
+#if SERVE_HAS_SPAN
+    void query_batch(std::span<const Key> keys, std::span<bool> out) const { query_batch(keys.data(), keys.size(), out.data()); }
+    void query_batch_sorted(std::span<const Key> keys, std::span<bool> out) const { query_batch_sorted(keys.data(), keys.size(), out.data()); }
+#endif
+
+    // Inserts x if absent; in map mode the new key gets a value-initialized payload.
+    void insert(Key x) {
+        if (blocks.empty()) {
+            BlockType b(arena.get()); b.insert(x);
+            blocks.push_back(std::move(b));
+            rebuildDirectory();
+            return;
+        }
+        int idx = findBlockForInsert(x);
+        blocks[idx].insert(x);
+        splitBlockIfNeeded(idx);
+    }
+
+    /**
+     * Inserts a batch of keys in one linear pass over the blocks: the batch is sorted and
+     * deduplicated, each block is merged with the slice of the batch that falls into it,
+     * and blocks that would overflow are re-cut into TARGET_BLOCK_SIZE pieces. Blocks
+     * that receive no keys are kept as they are. Map mode gives new keys a value-initialized payload.
+     */
+    void insert_bulk(const Key* keys, size_t n) {
+        if (n == 0) return;
+        std::vector<Key> batch(keys, keys + n);
+        sortKeys(batch.data(), batch.size());
+        batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+        if (blocks.empty()) {
+            BuildOptions sorted;
+            sorted.presorted = true;
+            build(std::move(batch), sorted);
+            return;
+        }
+
+        std::vector<BlockType> merged;
+        merged.reserve(blocks.size() + batch.size() / TARGET_BLOCK_SIZE + 1);
+        size_t j = 0;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            size_t k = batch.size();
+            if (i + 1 < blocks.size())
+                k = j + SearchKernels<Key>::active().lowerBound(batch.data() + j, batch.size() - j, blocks[i + 1].minVal);
+            if (k == j) { merged.push_back(std::move(blocks[i])); continue; }
+            mergeIntoBlocks(blocks[i], batch.data() + j, batch.data() + k, merged);
+            j = k;
+        }
+        blocks.swap(merged);
+        rebuildDirectory();
+    }
+
+    void insert_bulk(const std::vector<Key>& keys) { insert_bulk(keys.data(), keys.size()); }
+
+#if SERVE_HAS_SPAN
+    void insert_bulk(std::span<const Key> keys) { insert_bulk(keys.data(), keys.size()); }
+#endif
+
+    // Removes x. Returns false when it was not present.
+    bool erase(Key x) {
+        int idx = findBlockContaining(x);
+        if (idx < 0 || !blocks[idx].remove(x)) return false;
+        mergeBlocksIfNeeded(idx);
+        return true;
+    }
+
+    /**
+     * Removes every key in [low, high] and returns how many were removed. Blocks that lie
+     * entirely inside the range are dropped whole; only the two boundary blocks are edited.
+     */
+    size_t erase_range(Key low, Key high) {
+        if (blocks.empty() || high < low) return 0;
+        size_t first = directoryLowerBound(low), last = first;
+        size_t removed = 0, fullFrom = blocks.size(), fullTo = blocks.size();
+        for (; last < blocks.size() && blocks[last].minVal <= high; ++last) {
+            BlockType& b = blocks[last];
+            if (low <= b.minVal && b.maxVal <= high) {
+                if (fullFrom == blocks.size()) fullFrom = last;
+                fullTo = last + 1;
+                removed += b.size();
+                continue;
+            }
+            auto [start, end] = b.rangeBounds(low, high);
+            removed += end - start;
+            b.eraseRange(start, end);
+        }
+        if (first == last) return 0;
+        // Full blocks form one contiguous run; at most one partial block sits on each side.
+        dropBlocks(fullFrom, fullTo);
+        size_t remaining = (last - first) - (fullTo - fullFrom);
+        if (remaining == 2) mergeBlocksIfNeeded(first + 1);
+        if (remaining >= 1) mergeBlocksIfNeeded(first);
+        return removed;
+    }
+
+    // Map mode: sets the payload of key, inserting it when absent. Returns true on insertion.
+    template <typename V = Value, EnableIfMap<V> = 0>
+    bool insert_or_assign(Key key, V value) {
+        if (blocks.empty()) {
+            blocks.emplace_back(arena.get());
+            fences.push_back(key);
+        }
+        int idx = findBlockForInsert(key);
+        bool inserted = false;
+        size_t pos = blocks[idx].insert(key, &inserted);
+        blocks[idx].values[pos] = std::move(value);
+        splitBlockIfNeeded(idx);
+        return inserted;
+    }
+
+    // Map mode: payload of key, or nullptr when absent. Invalidated by any insert or erase.
+    template <typename V = Value, EnableIfMap<V> = 0>
+    V* find(Key key) {
+        int idx = findBlockContaining(key);
+        if (idx < 0) return nullptr;
+        size_t pos = blocks[idx].locate(key);
+        if (pos == BlockType::npos) return nullptr;
+        blocks[idx].unshare();  // the caller may write through the pointer
+        return &blocks[idx].values[pos];
+    }
+
+    template <typename V = Value, EnableIfMap<V> = 0>
+    const V* find(Key key) const {
+        int idx = findBlockContaining(key);
+        if (idx < 0) return nullptr;
+        size_t pos = blocks[idx].locate(key);
+        return pos == BlockType::npos ? nullptr : &blocks[idx].values[pos];
+    }
+
+    // Map mode: calls f(key, value) for every key in [low, high], in ascending order.
+    template <typename F, typename V = Value, EnableIfMap<V> = 0>
+    void for_each_in_range(Key low, Key high, F&& f) {
+        visitRange(*this, low, high, f);
+    }
+
+    // Calls f(key) (set mode) or f(key, value) (map mode) for every key in [low, high], in ascending order.
+    template <typename F>
+    void for_each_in_range(Key low, Key high, F&& f) const {
+        visitRange(*this, low, high, f);
+    }
+
+    // Zero-copy alternative to rangeQuery: the keys in [low, high] as per-block slices.
+    RangeView<Key, BlockType> range(Key low, Key high) const {
+        if (high < low) return {};
+        size_t first = directoryLowerBound(low), last = directoryLowerBound(high);
+        if (last < blocks.size() && blocks[last].minVal <= high) ++last;
+        if (first >= last) return {};
+        size_t start = blocks[first].rangeBounds(low, high).first, end = blocks[last - 1].rangeBounds(low, high).second;
+        if (first + 1 == last && start == end) return {};
+        return RangeView<Key, BlockType>(blocks.data() + first, blocks.data() + last, start, end);
+    }
+
+    /**
+     * Aggregates over [low, high] without touching the keys in between: blocks the range
+     * covers contribute their size and cached keySum whole, and only the two boundary
+     * blocks are searched (and, for sum, partially added up).
+     */
+    size_t count(Key low, Key high) const {
+        return foldRange(low, high, size_t(0), [](const BlockType& b) { return (size_t)b.size(); },
+                         [](const BlockType&, size_t from, size_t to) { return to - from; });
+    }
+
+    sum_type sum(Key low, Key high) const {
+        using KeySum = typename BlockType::KeySum;
+        return (sum_type)foldRange(low, high, KeySum(0), [](const BlockType& b) { return b.keySum; },
+                                   [](const BlockType& b, size_t from, size_t to) { return b.sumRange(from, to); });
+    }
+
+    // Smallest key in [low, high] into out; false when the range is empty.
+    bool rangeMin(Key low, Key high, Key& out) const {
+        size_t i = directoryLowerBound(low);
+        if (high < low || i == blocks.size()) return false;
+        Key first = blocks[i].data[blocks[i].rangeBounds(low, high).first];
+        if (high < first) return false;
+        out = first;
+        return true;
+    }
+
+    // Largest key in [low, high] into out; false when the range is empty.
+    bool rangeMax(Key low, Key high, Key& out) const {
+        size_t i = directoryLowerBound(high);
+        if (i == blocks.size() || high < blocks[i].minVal) {
+            if (i == 0) return false;
+            --i;  // every key of blocks[i] lies above high
+        }
+        if (high < low) return false;
+        Key last = blocks[i].data[blocks[i].rangeBounds(low, high).second - 1];
+        if (last < low) return false;
+        out = last;
+        return true;
+    }
+
+    // Ranges of at least this many keys are copied out by several threads.
+    static constexpr size_t PARALLEL_RANGE_KEYS = size_t(1) << 20;
+    static constexpr size_t RANGE_CHUNK_BLOCKS = 16;
+
+    /**
+     * Sizes the result exactly before copying anything: the overlapping blocks and their
+     * output offsets come first, then each block is copied straight to its offset. Wide
+     * ranges are copied in RANGE_CHUNK_BLOCKS-block chunks by every core (see runChunks).
+     */
+    std::vector<Key> rangeQuery(Key low, Key high) const {
+        RangePlan plan = planRange(low, high);
+        std::vector<Key> res(plan.size());
+        size_t chunks = (plan.blocks() + RANGE_CHUNK_BLOCKS - 1) / RANGE_CHUNK_BLOCKS;
+        unsigned threads = plan.size() >= PARALLEL_RANGE_KEYS ? resolveThreadCount(0) : 1;
+        runChunks(chunks, threads, [&](size_t c) {
+            copyRange(plan, c * RANGE_CHUNK_BLOCKS, std::min(plan.blocks(), (c + 1) * RANGE_CHUNK_BLOCKS), res.data());
+        });
+        return res;
+    }
+
+    /**
+     * Writes the index in the IndexFileHeader layout. Set mode only. Returns false on I/O error.
+     */
+    template <typename V = Value, std::enable_if_t<std::is_void<V>::value, int> = 0>
+    bool save(const std::string& path) const {
+        auto align = [](uint64_t off) { return (off + 63) & ~uint64_t(63); };
+        IndexFileHeader header = {};
+        std::memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+        header.version = INDEX_FILE_VERSION;
+        header.keySize = sizeof(Key);
+        header.keyKind = indexKeyKind<Key>();
+        header.blockCount = blocks.size();
+        header.keyCount = getTotalElements();
+        header.fenceOffset = sizeof(IndexFileHeader);
+        header.tableOffset = align(header.fenceOffset + blocks.size() * sizeof(Key));
+        std::vector<IndexFileBlock> table(blocks.size());
+        uint64_t off = align(header.tableOffset + blocks.size() * sizeof(IndexFileBlock));
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            table[i] = {off, (uint64_t)blocks[i].size(), 0};
+            std::memcpy(&table[i].keySum, &blocks[i].keySum, sizeof(table[i].keySum));
+            off = align(off + blocks[i].size() * sizeof(Key));
+        }
+        header.fileSize = off;
+
+        std::FILE* f = std::fopen(path.c_str(), "wb");
+        if (!f) return false;
+        static const char zeros[64] = {};
+        uint64_t written = 0;
+        auto put = [&](const void* p, size_t bytes) {
+            if (bytes && std::fwrite(p, 1, bytes, f) != bytes) return false;
+            written += bytes;
+            return true;
+        };
+        auto padTo = [&](uint64_t target) { return put(zeros, target - written); };
+        bool ok = put(&header, sizeof(header)) && put(fences.data(), fences.size() * sizeof(Key)) &&
+                  padTo(header.tableOffset) && put(table.data(), table.size() * sizeof(IndexFileBlock));
+        for (size_t i = 0; ok && i < blocks.size(); ++i)
+            ok = padTo(table[i].offset) && put(blocks[i].data.data(), blocks[i].size() * sizeof(Key));
+        ok = ok && padTo(header.fileSize);
+        return std::fclose(f) == 0 && ok;
+    }
+
+#if SERVE_HAS_MMAP
+    /**
+     * Replaces the contents with an index written by save(), served straight from the
+     * mapped file: blocks and fences borrow the mapped pages and no key is copied or parsed.
+     * The mapping is private, so a later insert or erase copies only the pages it touches
+     * and never writes to the file. Returns false (leaving the index unchanged) when the
+     * file cannot be mapped, does not match this key type, or fails the structural checks
+     * (bounds, block order, fences agreeing with block ends). Keys inside a block are trusted.
+     */
+    template <typename V = Value, std::enable_if_t<std::is_void<V>::value, int> = 0>
+    bool open_mmap(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexFileHeader)) { ::close(fd); return false; }
+        size_t size = (size_t)st.st_size;
+        void* addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) return false;
+        std::shared_ptr<void> mapping(addr, [size](void* p) { ::munmap(p, size); });
+
+        const char* base = static_cast<const char*>(addr);
+        const IndexFileHeader* h = reinterpret_cast<const IndexFileHeader*>(base);
+        // Range checks are written as "offset <= size && count <= room" so a crafted header cannot wrap them.
+        auto fits = [size](uint64_t offset, uint64_t count, size_t width) {
+            return offset <= size && count <= (size - offset) / width;
+        };
+        bool valid = !std::memcmp(h->magic, INDEX_FILE_MAGIC, sizeof(h->magic)) && h->version == INDEX_FILE_VERSION &&
+                     h->keySize == sizeof(Key) && h->keyKind == indexKeyKind<Key>() && h->fileSize <= size &&
+                     h->fenceOffset % 64 == 0 && fits(h->fenceOffset, h->blockCount, sizeof(Key)) &&
+                     h->tableOffset % 8 == 0 && fits(h->tableOffset, h->blockCount, sizeof(IndexFileBlock));
+        if (!valid) return false;
+        const IndexFileBlock* table = reinterpret_cast<const IndexFileBlock*>(base + h->tableOffset);
+        const Key* fenceKeys = reinterpret_cast<const Key*>(base + h->fenceOffset);
+        // Only the first and last key of each block are read, so opening stays O(blocks).
+        uint64_t keyCount = 0;
+        for (uint64_t i = 0; valid && i < h->blockCount; ++i) {
+            valid = table[i].count > 0 && table[i].count <= UINT32_MAX && table[i].offset % 64 == 0 &&
+                    fits(table[i].offset, table[i].count, sizeof(Key));
+            if (!valid) break;
+            const Key* keys = reinterpret_cast<const Key*>(base + table[i].offset);
+            Key first = keys[0], last = keys[table[i].count - 1];
+            valid = first <= last && fenceKeys[i] == last && (i == 0 || fenceKeys[i - 1] < first);
+            keyCount += table[i].count;
+        }
+        if (!valid || keyCount != h->keyCount) return false;
+
+        clearBlocks();
+        backing = mapping;
+        blocks.reserve(h->blockCount);
+        for (uint64_t i = 0; i < h->blockCount; ++i) {
+            Key* keys = reinterpret_cast<Key*>(static_cast<char*>(addr) + table[i].offset);
+            blocks.emplace_back(arena.get());
+            blocks.back().data.borrow(keys, table[i].count);
+            blocks.back().minVal = keys[0];
+            blocks.back().maxVal = keys[table[i].count - 1];
+            std::memcpy(&blocks.back().keySum, &table[i].keySum, sizeof(table[i].keySum));
+        }
+        fences.borrow(reinterpret_cast<Key*>(static_cast<char*>(addr) + h->fenceOffset), h->blockCount);
+        rebuildSummary();
+        refreshLayout();
+        return true;
+    }
+#endif
+
+    void printStats() const {
+        std::cout << "Blocks: " << blocks.size() << " | Elements: " << getTotalElements()
+                  << " | Arena: " << arena->bytesReserved() / 1024 << " KB"
+                  << " | Kernels: " << simdLevelName(SearchKernels<Key>::active().level)
+                  << " | Layout: " << (layout == BlockLayout::STree ? "S-tree" : layout == BlockLayout::Learned ? "learned" : "sorted") << std::endl;
+        if (layout != BlockLayout::Sorted) return;
+        size_t perPath[SEARCH_PATH_COUNT] = {};
+        for (const auto& b : blocks) ++perPath[(int)b.path];
+        std::cout << "Search paths:";
+        for (int p = 0; p < (int)SearchPath::STree; ++p)
+            std::cout << " " << searchPathName((SearchPath)p) << " " << perPath[p] << " blocks"
+                      << (SERVE_PATH_COUNTERS ? " / " + std::to_string(searchPathCount((SearchPath)p)) + " lookups" : "")
+                      << (p + 1 < (int)SearchPath::STree ? "," : "");
+        std::cout << std::endl;
+    }
+
+    size_t getTotalElements() const {
+        size_t total = 0;
+        for (const auto& b : blocks) total += b.size();
+        return total;
+    }
+
+    /**
+     * Returns an immutable view of the current contents that later writes do not affect
+     * (see ServeSnapshot). Not const: it hands the blocks' storage to a shared lease, so
+     * call it from the thread that writes to the index.
+     */
+    ServeSnapshot<Key, Value> snapshot() {
+        static_assert(!isMap || std::is_copy_constructible<Value>::value, "snapshots copy payloads on write");
+        ServeSnapshot<Key, Value> snap;
+        snap.parts.reserve(blocks.size());
+        snap.fences.reserve(blocks.size());
+        snap.pins.reserve(blocks.size());
+        for (auto& b : blocks) {
+            snap.pins.push_back(b.pin(arena, backing));
+            if constexpr (isMap) snap.parts.push_back({b.data.data(), b.values.data(), b.data.size()});
+            else snap.parts.push_back({b.data.data(), nullptr, b.data.size()});
+            snap.fences.push_back(b.maxVal);
+            snap.total += b.size();
+        }
+        return snap;
+    }
+
+private:
+    // The blocks overlapping a key range: plan block j is blocks[first + j], and its keys
+    // [bounds[j].first, bounds[j].second) go to output offset offsets[j].
+    struct RangePlan {
+        size_t first = 0;
+        std::vector<std::pair<size_t, size_t>> bounds;
+        std::vector<size_t> offsets{0};
+
+        size_t blocks() const { return bounds.size(); }
+        size_t size() const { return offsets.back(); }
+    };
+
+    RangePlan planRange(Key low, Key high) const {
+        RangePlan plan;
+        if (high < low) return plan;
+        plan.first = directoryLowerBound(low);
+        for (size_t i = plan.first; i < blocks.size() && blocks[i].minVal <= high; ++i) {
+            const BlockType& b = blocks[i];
+            bool whole = low <= b.minVal && b.maxVal <= high;
+            plan.bounds.push_back(whole ? std::make_pair(size_t(0), b.data.size()) : b.rangeBounds(low, high));
+            plan.offsets.push_back(plan.offsets.back() + plan.bounds.back().second - plan.bounds.back().first);
+        }
+        return plan;
+    }
+
+    // Copies plan blocks [from, to) to their offsets in out.
+    void copyRange(const RangePlan& plan, size_t from, size_t to, Key* out) const {
+        for (size_t j = from; j < to; ++j) {
+            const Key* keys = blocks[plan.first + j].data.data();
+            std::copy(keys + plan.bounds[j].first, keys + plan.bounds[j].second, out + plan.offsets[j]);
+        }
+    }
+
+    // Sums whole(b) over the blocks [low, high] covers and part(b, from, to) over its boundary blocks.
+    template <typename T, typename Whole, typename Part>
+    T foldRange(Key low, Key high, T total, Whole whole, Part part) const {
+        if (high < low) return total;
+        for (size_t i = directoryLowerBound(low); i < blocks.size() && blocks[i].minVal <= high; ++i) {
+            const BlockType& b = blocks[i];
+            if (low <= b.minVal && b.maxVal <= high) {
+                total += whole(b);
+            } else {
+                auto [from, to] = b.rangeBounds(low, high);
+                total += part(b, from, to);
+            }
+        }
+        return total;
+    }
+
+    template <typename Self, typename F>
+    static void visitRange(Self& self, Key low, Key high, F& f) {
+        for (auto it = self.blocks.begin() + self.directoryLowerBound(low); it != self.blocks.end() && it->minVal <= high; ++it) {
+            if constexpr (!std::is_const<Self>::value) it->unshare();  // f may modify payloads
+            auto [start, end] = it->rangeBounds(low, high);
+            for (size_t i = start; i < end; ++i) {
+                if constexpr (isMap) f(it->data[i], it->values[i]);
+                else f(it->data[i]);
+            }
+        }
+    }
+};
+
+/**
+ * Builds an UltimateHybridSearch from a stream of key chunks with bounded memory.
+ *
+ * Sorted runs that continue past the largest key seen so far are turned into blocks as
+ * they arrive. Everything else is buffered up to `runBytes`, then sorted, deduplicated and
+ * spilled to a temporary file in `tempDir`. finish() k-way merges the spilled runs, the
+ * buffer and the blocks already emitted; each emitted block is released as soon as it has
+ * been consumed, so its slab is reused for the output. Peak memory stays near the final
+ * index size plus one run buffer and a small read buffer per spilled run.
+ *
+ * The target is cleared on construction and must not be used until finish() returns.
+ * Methods return false on I/O errors. A builder destroyed without finish() leaves the
+ * target empty.
+ */
+template <typename Key>
+class StreamingBuilder {
+public:
+    using Index = UltimateHybridSearch<Key>;
+
+    explicit StreamingBuilder(Index& target, std::string tempDir = std::string(), size_t runBytes = size_t(64) << 20)
+        : index(target), dir(std::move(tempDir)), runKeys(std::max<size_t>(1, runBytes / sizeof(Key))) {
+        if (dir.empty()) {
+            std::error_code ec;
+            dir = std::filesystem::temp_directory_path(ec).string();
+            if (ec) dir = ".";
+        }
+        index.clearBlocks();
+    }
+
+    StreamingBuilder(const StreamingBuilder&) = delete;
+    StreamingBuilder& operator=(const StreamingBuilder&) = delete;
+
+    ~StreamingBuilder() {
+        discardRuns();
+        if (!finished) index.clearBlocks();  // blocks emitted so far have no directory
+    }
+
+    // Keys in ascending order. Emitted directly when they continue the stream, buffered otherwise.
+    bool addSortedRun(const Key* keys, size_t n) {
+        if (n == 0) return true;
+        if (!index.blocks.empty() && !(index.blocks.back().maxVal < keys[0])) return addChunk(keys, n);
+        for (size_t i = 0; i < n; ++i) index.appendSorted(keys[i]);
+        return true;
+    }
+
+    // Keys in any order.
+    bool addChunk(const Key* keys, size_t n) {
+        while (n) {
+            size_t take = std::min(n, runKeys - pending.size());
+            pending.insert(pending.end(), keys, keys + take);
+            keys += take; n -= take;
+            if (pending.size() == runKeys && !spill()) return false;
+        }
+        return true;
+    }
+
+    bool addSortedRun(const std::vector<Key>& keys) { return addSortedRun(keys.data(), keys.size()); }
+    bool addChunk(const std::vector<Key>& keys) { return addChunk(keys.data(), keys.size()); }
+
+    // Merges everything into the target and removes the spill files.
+    bool finish() {
+        finished = true;
+        if (runs.empty() && pending.empty()) {
+            index.rebuildDirectory();
+            return true;
+        }
+        sortPending();
+        std::vector<typename Index::BlockType> emitted;
+        emitted.swap(index.blocks);
+        index.clearBlocks();
+
+        // Sources: 0 = emitted blocks, 1 = pending buffer, 2.. = spilled runs.
+        size_t blockIdx = 0, blockPos = 0, pendingPos = 0;
+        auto next = [&](size_t src, Key& out) -> bool {
+            if (src == 0) {
+                while (blockIdx < emitted.size() && blockPos == emitted[blockIdx].data.size()) {
+                    emitted[blockIdx] = typename Index::BlockType(index.arena.get());
+                    ++blockIdx; blockPos = 0;
+                }
+                if (blockIdx == emitted.size()) return false;
+                out = emitted[blockIdx].data[blockPos++];
+                return true;
+            }
+            if (src == 1) {
+                if (pendingPos == pending.size()) return false;
+                out = pending[pendingPos++];
+                return true;
+            }
+            return runs[src - 2].next(out);
+        };
+
+        using Head = std::pair<Key, size_t>;
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heap;
+        for (size_t s = 0; s < runs.size() + 2; ++s) {
+            Key k;
+            if (next(s, k)) heap.push({k, s});
+        }
+        while (!heap.empty()) {
+            Head h = heap.top();
+            heap.pop();
+            index.appendSorted(h.first);
+            Key k;
+            if (next(h.second, k)) heap.push({k, h.second});
+        }
+        bool ok = true;
+        for (auto& r : runs) ok = ok && !r.failed;
+        std::vector<Key>().swap(pending);
+        discardRuns();
+        index.rebuildDirectory();
+        return ok;
+    }
+
+private:
+    static constexpr size_t READ_BUFFER_KEYS = size_t(1) << 14;
+
+    struct SpillRun {
+        std::string path;
+        std::FILE* file = nullptr;
+        std::vector<Key> buffer;
+        size_t pos = 0;
+        bool failed = false;
+
+        bool next(Key& out) {
+            if (pos == buffer.size()) {
+                if (!file) return false;
+                buffer.resize(READ_BUFFER_KEYS);
+                size_t got = std::fread(buffer.data(), sizeof(Key), buffer.size(), file);
+                if (got < buffer.size() && std::ferror(file)) failed = true;
+                buffer.resize(got);
+                pos = 0;
+                if (got == 0) return false;
+            }
+            out = buffer[pos++];
+            return true;
+        }
+    };
+
+    void sortPending() {
+        sortKeys(pending.data(), pending.size());
+        pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+    }
+
+    bool spill() {
+        sortPending();
+        SpillRun run;
+        run.file = createRunFile(run.path);
+        if (!run.file) return false;
+        runs.push_back(std::move(run));
+        SpillRun& r = runs.back();
+        if (std::fwrite(pending.data(), sizeof(Key), pending.size(), r.file) != pending.size() ||
+            std::fflush(r.file) != 0)
+            return false;
+        std::rewind(r.file);
+        pending.clear();
+        return true;
+    }
+
+    // Opens a new spill file under a name nobody else holds (mkstemp creates it exclusively),
+    // so concurrent builders cannot collide and a pre-planted path is never followed.
+    std::FILE* createRunFile(std::string& path) const {
+#if SERVE_HAS_MMAP
+        std::string pattern = (std::filesystem::path(dir) / "serve-run-XXXXXX").string();
+        std::vector<char> name(pattern.begin(), pattern.end());
+        name.push_back('\0');
+        int fd = ::mkstemp(name.data());
+        if (fd < 0) return nullptr;
+        path = name.data();
+        std::FILE* f = ::fdopen(fd, "w+b");
+        if (!f) {
+            ::close(fd);
+            std::remove(path.c_str());
+            path.clear();
+        }
+        return f;
+#else
+        path.clear();
+        return std::tmpfile();  // deleted on close
+#endif
+    }
+
+    void discardRuns() {
+        for (auto& r : runs) {
+            if (r.file) std::fclose(r.file);
+            if (!r.path.empty()) std::remove(r.path.c_str());
+        }
+        runs.clear();
+    }
+
+    Index& index;
+    std::string dir;
+    size_t runKeys;
+    std::vector<Key> pending;
+    std::vector<SpillRun> runs;
+    bool finished = false;
+};
+
+/**
+ * Thread-safe UltimateHybridSearch for read-mostly workloads: readers never write a shared
+ * cache line.
+ *
+ * Every block carries a seqlock version. Readers search optimistically, then re-check the
+ * version and retry if a writer got in between. A write that stays inside one block (the
+ * key lies within the block's key range, the block neither overflows nor underflows and
+ * its slab has room) makes that block's version odd for the duration of the edit, so it
+ * stalls nobody but its own block's readers. Such writes never move the slab, and keys
+ * only shift inside it, so a racing reader sees stale keys at worst, never freed memory.
+ *
+ * Anything that reshapes the directory (a new block minimum or maximum, split, merge, slab
+ * growth, bulk operations) is a structural write. It flips the structure version odd,
+ * waits for the threads already inside a read section to leave (a grace period, so blocks
+ * and slabs it frees are never in use) and runs the single-threaded code. Threads announce
+ * read sections in per-thread-slot counters on their own cache lines.
+ *
+ * rangeQuery is consistent per block, not across the range: a write to a block the scan
+ * has already passed is not reflected. Map payloads are read optimistically only when
+ * trivially copyable; other payload types are copied with the block's version held.
+ */
+template <typename Key = int, typename Value = void>
+class ConcurrentServe {
+public:
+    using Index = UltimateHybridSearch<Key, Value>;
+
+private:
+    using BlockType = Block<Key, Value>;
+    template <typename V>
+    using EnableIfMap = std::enable_if_t<!std::is_void<V>::value, int>;
+
+    // Even while the block is stable; odd while a writer edits it.
+    struct alignas(64) Latch {
+        std::atomic<uint64_t> version{0};
+    };
+
+    static constexpr size_t READER_SLOTS = 64;
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint32_t> active{0};
+    };
+
+    Index index;
+    // latches[i] guards index.blocks[i]; only grown, inside a structural write.
+    std::vector<std::unique_ptr<Latch>> latches;
+    mutable ReaderSlot readers[READER_SLOTS];
+    // Odd while a structural write is in progress.
+    mutable std::atomic<uint64_t> structureVersion{0};
+    std::mutex structuralWriter;
+
+    static inline void relax() { std::this_thread::yield(); }
+
+    static size_t readerSlot() {
+        static std::atomic<size_t> next{0};
+        thread_local size_t slot = next.fetch_add(1, std::memory_order_relaxed) % READER_SLOTS;
+        return slot;
+    }
+
+    // Announces a reader (or in-block writer) to structural writers for its lifetime.
+    class ReadSection {
+    public:
+        explicit ReadSection(const ConcurrentServe& s) : owner(s), slot(s.readers[readerSlot()].active) {
+            for (;;) {
+                slot.fetch_add(1, std::memory_order_seq_cst);
+                if (!(owner.structureVersion.load(std::memory_order_seq_cst) & 1)) return;
+                slot.fetch_sub(1, std::memory_order_release);
+                while (owner.structureVersion.load(std::memory_order_acquire) & 1) relax();
+            }
+        }
+        ~ReadSection() { slot.fetch_sub(1, std::memory_order_release); }
+        ReadSection(const ReadSection&) = delete;
+        ReadSection& operator=(const ReadSection&) = delete;
+
+    private:
+        const ConcurrentServe& owner;
+        std::atomic<uint32_t>& slot;
+    };
+
+    void syncLatches() {
+        while (latches.size() < index.blocks.size()) latches.emplace_back(new Latch());
+    }
+
+    // Runs f(index) with every reader and in-block writer drained.
+    template <typename F>
+    auto exclusive(F&& f) {
+        std::lock_guard<std::mutex> lock(structuralWriter);
+        structureVersion.fetch_add(1, std::memory_order_seq_cst);
+        for (auto& r : readers)
+            while (r.active.load(std::memory_order_seq_cst)) relax();
+        struct Publish {
+            ConcurrentServe* self;
+            ~Publish() {
+                self->syncLatches();
+                self->structureVersion.fetch_add(1, std::memory_order_release);
+            }
+        } publish{this};
+        return f(index);
+    }
+
+    // Calls f(block) until it runs without a concurrent in-block write; f must be repeatable.
+    template <typename F>
+    auto readBlock(size_t idx, F&& f) const {
+        const std::atomic<uint64_t>& version = latches[idx]->version;
+        for (;;) {
+            uint64_t before = version.load(std::memory_order_acquire);
+            if (before & 1) { relax(); continue; }
+            auto result = f(index.blocks[idx]);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version.load(std::memory_order_relaxed) == before) return result;
+        }
+    }
+
+    void lockBlock(size_t idx) const {
+        std::atomic<uint64_t>& version = latches[idx]->version;
+        uint64_t v = version.load(std::memory_order_relaxed);
+        while ((v & 1) || !version.compare_exchange_weak(v, v + 1, std::memory_order_acquire)) {
+            relax();
+            v = version.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void unlockBlock(size_t idx) const { latches[idx]->version.fetch_add(1, std::memory_order_release); }
+
+    // Whether a write of x can stay inside b without touching the directory or the arena.
+    static bool fitsInPlace(const BlockType& b, Key x) {
+        bool roomy = b.data.ownsStorage() && b.data.size() < b.data.capacity();
+        if constexpr (BlockType::hasPayload) roomy = roomy && b.values.size() < b.values.capacity();
+        return roomy && b.minVal <= x && x <= b.maxVal && b.size() < MAX_BLOCK_SIZE;
+    }
+
+    static bool erasesInPlace(const BlockType& b, Key x) {
+        return b.data.ownsStorage() && b.minVal < x && x < b.maxVal && b.size() > MERGE_THRESHOLD;
+    }
+
+    // Runs edit(block) -> true under the block's version when the write stays inside the
+    // block holding key; false sends the caller down the structural path.
+    template <typename F>
+    bool editInPlace(Key key, F&& edit) {
+        ReadSection section(*this);
+        size_t idx = index.directoryLowerBound(key);
+        if (idx == index.blocks.size()) return false;
+        lockBlock(idx);
+        bool done = edit(index.blocks[idx]);
+        unlockBlock(idx);
+        return done;
+    }
+
+public:
+    ConcurrentServe() = default;
+    ConcurrentServe(const ConcurrentServe&) = delete;
+    ConcurrentServe& operator=(const ConcurrentServe&) = delete;
+
+    void build(std::vector<Key>& data, const BuildOptions& options = BuildOptions()) {
+        exclusive([&](Index& i) { i.build(data, options); });
+    }
+
+    template <typename V = Value, EnableIfMap<V> = 0>
+    void build(std::vector<std::pair<Key, V>>& items) {
+        exclusive([&](Index& i) { i.build(items); });
+    }
+
+    void setLayout(BlockLayout l) { exclusive([&](Index& i) { i.setLayout(l); }); }
+    void refreshLayout() { exclusive([](Index& i) { i.refreshLayout(); }); }
+
+    // Consistent view for long scans; briefly drains readers like any structural write.
+    ServeSnapshot<Key, Value> snapshot() {
+        return exclusive([](Index& i) { return i.snapshot(); });
+    }
+
+    bool query(Key x) const {
+        ReadSection section(*this);
+        size_t idx = index.directoryLowerBound(x);
+        if (idx == index.blocks.size()) return false;
+        return readBlock(idx, [x](const BlockType& b) { return b.minVal <= x && b.search(x); });
+    }
+
+    void query_batch(const Key* keys, size_t n, bool* out) const {
+        for (size_t i = 0; i < n; ++i) out[i] = query(keys[i]);
+    }
+
+    std::vector<Key> rangeQuery(Key low, Key high) const {
+        std::vector<Key> res;
+        ReadSection section(*this);
+        for (size_t idx = index.directoryLowerBound(low); idx < index.blocks.size(); ++idx) {
+            size_t mark = res.size();
+            bool past = readBlock(idx, [&](const BlockType& b) {
+                res.resize(mark);
+                if (high < b.minVal) return true;
+                auto [start, end] = b.rangeBounds(low, high);
+                res.insert(res.end(), b.data.begin() + start, b.data.begin() + end);
+                return false;
+            });
+            if (past) break;
+        }
+        return res;
+    }
+
+    void insert(Key x) {
+        bool done = editInPlace(x, [x](BlockType& b) {
+            if (!fitsInPlace(b, x)) return false;
+            b.insert(x);
+            return true;
+        });
+        if (done) return;
+        exclusive([&](Index& i) { i.insert(x); });
+    }
+
+    bool erase(Key x) {
+        int result = -1;  // -1: needs the structural path
+        editInPlace(x, [&](BlockType& b) {
+            if (x < b.minVal) result = 0;
+            else if (erasesInPlace(b, x)) result = b.remove(x);
+            return result >= 0;
+        });
+        if (result >= 0) return result;
+        return exclusive([&](Index& i) { return i.erase(x); });
+    }
+
+    size_t erase_range(Key low, Key high) {
+        return exclusive([&](Index& i) { return i.erase_range(low, high); });
+    }
+
+    void insert_bulk(const Key* keys, size_t n) {
+        exclusive([&](Index& i) { i.insert_bulk(keys, n); });
+    }
+
+    // Map mode: sets the payload of key, inserting it when absent. Returns true on insertion.
+    template <typename V = Value, EnableIfMap<V> = 0>
+    bool insert_or_assign(Key key, V value) {
+        bool inserted = false;
+        if (editInPlace(key, [&](BlockType& b) {
+                if (!fitsInPlace(b, key)) return false;
+                b.values[b.insert(key, &inserted)] = std::move(value);
+                return true;
+            }))
+            return inserted;
+        return exclusive([&](Index& i) { return i.insert_or_assign(key, std::move(value)); });
+    }
+
+    // Map mode: copies the payload of key into out. Returns false when key is absent.
+    template <typename V = Value, EnableIfMap<V> = 0>
+    bool get(Key key, V& out) const {
+        ReadSection section(*this);
+        size_t idx = index.directoryLowerBound(key);
+        if (idx == index.blocks.size()) return false;
+        auto locate = [key](const BlockType& b) { return b.minVal <= key ? b.locate(key) : BlockType::npos; };
+        if constexpr (std::is_trivially_copyable<V>::value) {
+            return readBlock(idx, [&](const BlockType& b) {
+                size_t pos = locate(b);
+                if (pos != BlockType::npos) out = b.values[pos];
+                return pos != BlockType::npos;
+            });
+        } else {
+            lockBlock(idx);
+            const BlockType& b = index.blocks[idx];
+            size_t pos = locate(b);
+            if (pos != BlockType::npos) out = b.values[pos];
+            unlockBlock(idx);
+            return pos != BlockType::npos;
+        }
+    }
+
+    size_t getTotalElements() const {
+        ReadSection section(*this);
+        size_t total = 0;
+        for (size_t i = 0; i < index.blocks.size(); ++i)
+            total += readBlock(i, [](const BlockType& b) { return b.data.size(); });
+        return total;
+    }
+
+    // Runs as a structural write, so the figures are exact.
+    void printStats() {
+        exclusive([](Index& i) { i.printStats(); });
+    }
+};
+
+/**
+ * Range-partitioned SERVE for write-heavy workloads: the key space is cut into a fixed
+ * number of shards, each an independent UltimateHybridSearch with its own reader-writer
+ * lock and arena, so writers to different shards never share a lock, a directory or a
+ * cache line. shardOf(key) is stable between rebalances, which lets a caller dedicate
+ * one writer thread per shard.
+ *
+ * build() picks the shard boundaries from a sample of the input. When a split leaves a
+ * shard holding more than SHARD_SKEW_PERCENT of the mean shard's blocks, every shard is
+ * re-cut evenly, as rebalance() does. A shard owns
+ * [its lower bound, the next shard's lower bound); a bound only moves while both shards
+ * on either side of it are locked, so an operation routes without locking, locks its
+ * shard and re-checks ownership.
+ *
+ * Range operations lock the shards they span in ascending order; wide rangeQuery results
+ * are copied out of all of them in parallel. Results are consistent across the whole range.
+ */
+template <typename Key = int, typename Value = void>
+class ShardedServe {
+public:
+    using Index = UltimateHybridSearch<Key, Value>;
+
+    static constexpr size_t SHARD_SKEW_PERCENT = 150;
+    static constexpr size_t SHARD_REBALANCE_MIN_BLOCKS = 16;
+    // Blocks one balancing step moves across each shard boundary it shifts.
+    static constexpr size_t SHARD_MIGRATE_BLOCKS = 8;
+    static constexpr size_t SAMPLE_PER_SHARD = 64;
+
+private:
+    static constexpr bool isMap = !std::is_void<Value>::value;
+    template <typename V>
+    using EnableIfMap = std::enable_if_t<!std::is_void<V>::value, int>;
+    using Item = std::conditional_t<isMap, std::pair<Key, std::conditional_t<isMap, Value, char>>, Key>;
+    using SharedLock = std::shared_lock<std::shared_mutex>;
+    using UniqueLock = std::unique_lock<std::shared_mutex>;
+
+    // The bound every router reads sits apart from the lock every writer takes.
+    struct Shard {
+        alignas(64) std::atomic<Key> lower{Key()};  // unused for shard 0, which also takes every smaller key
+        alignas(64) mutable std::shared_mutex lock;
+        std::atomic<size_t> blockCount{0};  // mirrors index.blocks.size() for the skew check
+        Index index;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    static Key keyOf(const Item& item) {
+        if constexpr (isMap) return item.first;
+        else return item;
+    }
+
+    // Lock-free guess at the shard owning x; confirm with owns() once the shard is locked.
+    size_t route(Key x) const {
+        size_t lo = 0, hi = shards.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (shards[mid]->lower.load(std::memory_order_relaxed) <= x) lo = mid;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    // Whether shards first..last own all of [low, high]; needs first and last locked.
+    bool owns(size_t first, size_t last, Key low, Key high) const {
+        return (first == 0 || shards[first]->lower.load(std::memory_order_relaxed) <= low) &&
+               (last + 1 == shards.size() || high < shards[last + 1]->lower.load(std::memory_order_relaxed));
+    }
+
+    void publishBlockCount(size_t s) {
+        shards[s]->blockCount.store(shards[s]->index.blocks.size(), std::memory_order_relaxed);
+    }
+
+    template <typename F>
+    auto readShard(Key key, F&& f) const {
+        for (;;) {
+            size_t s = route(key);
+            SharedLock lock(shards[s]->lock);
+            if (owns(s, s, key, key)) return f(static_cast<const Index&>(shards[s]->index));
+        }
+    }
+
+    // Runs f(index) -> result with key's shard locked, then rebalances it if a split skewed it.
+    template <typename F>
+    auto writeShard(Key key, F&& f) {
+        for (;;) {
+            size_t s = route(key);
+            UniqueLock lock(shards[s]->lock);
+            if (!owns(s, s, key, key)) continue;
+            size_t before = shards[s]->index.blocks.size();
+            auto result = f(shards[s]->index);
+            publishBlockCount(s);
+            bool reshaped = shards[s]->index.blocks.size() != before;
+            lock.unlock();
+            if (reshaped) balance(s);
+            return result;
+        }
+    }
+
+    // Runs f(first, last) with the shards spanning [low, high] locked in ascending order.
+    template <typename Lock, typename F>
+    auto spanShards(Key low, Key high, F&& f) const {
+        for (;;) {
+            size_t first = route(low), last = std::max(first, route(high));
+            std::vector<Lock> locks;
+            locks.reserve(last - first + 1);
+            for (size_t s = first; s <= last; ++s) locks.emplace_back(shards[s]->lock);
+            if (owns(first, last, low, high)) return f(first, last);
+        }
+    }
+
+    std::vector<UniqueLock> lockAll() const {
+        std::vector<UniqueLock> locks;
+        locks.reserve(shards.size());
+        for (auto& s : shards) locks.emplace_back(s->lock);
+        return locks;
+    }
+
+    // Moves the contents of index, in key order, onto the end of out and leaves it empty.
+    static void drain(Index& index, std::vector<Item>& out) {
+        for (auto& b : index.blocks)
+            for (size_t j = 0; j < b.data.size(); ++j) {
+                if constexpr (isMap) out.emplace_back(b.data[j], std::move(b.values[j]));
+                else out.push_back(b.data[j]);
+            }
+        index.clearBlocks();
+    }
+
+    // Rebuilds index from sorted, unique items.
+    static void fill(Index& index, std::vector<Item>&& items) {
+        if constexpr (isMap) {
+            index.build(items);
+        } else {
+            BuildOptions sorted;
+            sorted.presorted = true;
+            index.build(std::move(items), sorted);
+        }
+    }
+
+    // Distributes sorted, unique items over all shards in equal runs; every shard is locked.
+    void redistribute(std::vector<Item>& items) {
+        size_t n = shards.size();
+        for (size_t s = 1; s < n && !items.empty(); ++s)
+            shards[s]->lower.store(keyOf(items[std::min(items.size() - 1, items.size() * s / n)]), std::memory_order_relaxed);
+        runChunks(n, resolveThreadCount(0), [&](size_t s) {
+            auto first = items.begin() + items.size() * s / n, last = items.begin() + items.size() * (s + 1) / n;
+            fill(shards[s]->index, std::vector<Item>(std::make_move_iterator(first), std::make_move_iterator(last)));
+            publishBlockCount(s);
+        });
+    }
+
+    // Whether a shard of `blocks` blocks holds more than SHARD_SKEW_PERCENT of the mean.
+    bool skewed(size_t blocks, size_t total) const {
+        return blocks * 100 * shards.size() > SHARD_SKEW_PERCENT * total + 100 * shards.size() * SHARD_REBALANCE_MIN_BLOCKS;
+    }
+
+    size_t totalBlocks() const {
+        size_t total = 0;
+        for (auto& shard : shards) total += shard->blockCount.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // Moves up to count whole blocks from shard `from` to the adjoining end of the neighbour
+    // `to`, always leaving `from` one block, and moves the bound between them to match.
+    // Both shards are locked. The blocks are rebuilt in the receiving index's arena.
+    void shiftBlocks(size_t from, size_t to, size_t count) {
+        Index& src = shards[from]->index;
+        Index& dst = shards[to]->index;
+        count = std::min(count, src.blocks.size() > 0 ? src.blocks.size() - 1 : 0);
+        if (count == 0) return;
+        bool rightward = to > from;
+        auto first = rightward ? src.blocks.end() - count : src.blocks.begin();
+        std::vector<typename Index::BlockType> moved;
+        moved.reserve(count);
+        for (auto it = first; it != first + count; ++it) {
+            moved.emplace_back(dst.arena.get());
+            auto& b = moved.back();
+            b.data.assign(it->data.begin(), it->data.end());
+            if constexpr (isMap) b.values.assign(std::make_move_iterator(it->values.begin()), std::make_move_iterator(it->values.end()));
+            b.minVal = it->minVal; b.maxVal = it->maxVal;
+            b.keySum = it->keySum; b.sumCarry = it->sumCarry;
+        }
+        src.blocks.erase(first, first + count);
+        dst.blocks.insert(rightward ? dst.blocks.begin() : dst.blocks.end(), std::make_move_iterator(moved.begin()),
+                          std::make_move_iterator(moved.end()));
+        size_t upper = std::max(from, to);
+        shards[upper]->lower.store(shards[upper]->index.blocks.front().minVal, std::memory_order_relaxed);
+        src.rebuildDirectory();
+        dst.rebuildDirectory();
+        publishBlockCount(from);
+        publishBlockCount(to);
+    }
+
+    /**
+     * Called after shard s gained blocks. When s holds more than SHARD_SKEW_PERCENT of the
+     * mean, SHARD_MIGRATE_BLOCKS blocks are passed boundary by boundary towards the lightest
+     * shard, each step locking only the two shards on either side of the bound it moves.
+     * A step costs O(SHARD_MIGRATE_BLOCKS) blocks per boundary however large the index is,
+     * so no write stalls the other shards; repeated steps as s keeps growing even it out.
+     */
+    void balance(size_t s) {
+        if (!skewed(shards[s]->blockCount.load(std::memory_order_relaxed), totalBlocks())) return;
+        size_t target = s;
+        for (size_t t = 0; t < shards.size(); ++t) {
+            size_t blocks = shards[t]->blockCount.load(std::memory_order_relaxed);
+            size_t best = shards[target]->blockCount.load(std::memory_order_relaxed);
+            size_t distance = t > s ? t - s : s - t, bestDistance = target > s ? target - s : s - target;
+            if (blocks < best || (blocks == best && distance < bestDistance)) target = t;
+        }
+        if (target == s) return;
+        for (size_t from = s; from != target;) {
+            size_t to = target > from ? from + 1 : from - 1;
+            UniqueLock first(shards[std::min(from, to)]->lock), second(shards[std::max(from, to)]->lock);
+            // Only the first step re-checks: later ones pass on what the first one moved.
+            if (from == s && !skewed(shards[s]->index.blocks.size(), totalBlocks())) return;
+            shiftBlocks(from, to, SHARD_MIGRATE_BLOCKS);
+            from = to;
+        }
+    }
+
+    // Redistributes the contents evenly; every shard is locked.
+    void recut() {
+        std::vector<Item> items;
+        for (auto& shard : shards) drain(shard->index, items);
+        redistribute(items);
+    }
+
+    // Moves items into one bucket per shard by the current bounds; every shard is locked.
+    template <typename T, typename KeyOf>
+    std::vector<std::vector<T>> partition(std::vector<T>& items, KeyOf keyOfItem) const {
+        std::vector<std::vector<T>> parts(shards.size());
+        for (auto& item : items) parts[route(keyOfItem(item))].push_back(std::move(item));
+        return parts;
+    }
+
+    // Sets the shard bounds to quantiles of a strided sample of items; every shard is locked.
+    template <typename T, typename KeyOf>
+    void chooseBounds(const std::vector<T>& items, KeyOf keyOfItem) {
+        if (items.empty()) return;
+        size_t samples = std::min(items.size(), SAMPLE_PER_SHARD * shards.size());
+        std::vector<Key> sample(samples);
+        for (size_t k = 0; k < samples; ++k) sample[k] = keyOfItem(items[items.size() * k / samples]);
+        sortKeys(sample.data(), sample.size());
+        for (size_t s = 1; s < shards.size(); ++s)
+            shards[s]->lower.store(sample[samples * s / shards.size()], std::memory_order_relaxed);
+    }
+
+public:
+    // Until the first build(), every key routes to shard 0 and balancing spreads them out.
+    explicit ShardedServe(size_t shardCount = resolveThreadCount(0)) {
+        shards.resize(std::max<size_t>(shardCount, 1));
+        for (auto& s : shards) {
+            s.reset(new Shard());
+            s->lower.store(std::numeric_limits<Key>::max(), std::memory_order_relaxed);
+        }
+    }
+    ShardedServe(const ShardedServe&) = delete;
+    ShardedServe& operator=(const ShardedServe&) = delete;
+
+    size_t shardCount() const { return shards.size(); }
+
+    // Shard currently owning key; changes only when a rebalance moves a bound past it.
+    size_t shardOf(Key key) const { return route(key); }
+
+    // Leaves data untouched; each shard sorts and adopts its own slice, all shards in parallel.
+    void build(const std::vector<Key>& data) {
+        auto locks = lockAll();
+        auto self = [](Key k) { return k; };
+        chooseBounds(data, self);
+        std::vector<Key> copy(data);
+        auto parts = partition(copy, self);
+        runChunks(shards.size(), resolveThreadCount(0), [&](size_t s) {
+            shards[s]->index.build(std::move(parts[s]));
+            publishBlockCount(s);
+        });
+    }
+
+    // Map mode: moves the pairs out of items; for duplicate keys the last pair wins.
+    template <typename V = Value, EnableIfMap<V> = 0>
+    void build(std::vector<std::pair<Key, V>>& items) {
+        auto locks = lockAll();
+        auto first = [](const std::pair<Key, V>& item) { return item.first; };
+        chooseBounds(items, first);
+        auto parts = partition(items, first);
+        items.clear();
+        runChunks(shards.size(), resolveThreadCount(0), [&](size_t s) {
+            shards[s]->index.build(parts[s]);
+            publishBlockCount(s);
+        });
+    }
+
+    // Re-cuts every shard to an equal share of the keys. Locks every shard and copies the
+    // whole index, unlike the bounded steps writes take on their own.
+    void rebalance() {
+        auto locks = lockAll();
+        recut();
+    }
+
+    void setLayout(BlockLayout l) {
+        for (size_t s = 0; s < shards.size(); ++s) {
+            UniqueLock lock(shards[s]->lock);
+            shards[s]->index.setLayout(l);
+        }
+    }
+
+    void refreshLayout() {
+        for (size_t s = 0; s < shards.size(); ++s) {
+            UniqueLock lock(shards[s]->lock);
+            shards[s]->index.refreshLayout();
+        }
+    }
+
+    bool query(Key x) const {
+        return readShard(x, [x](const Index& i) { return i.query(x); });
+    }
+
+    void query_batch(const Key* keys, size_t n, bool* out) const {
+        for (size_t i = 0; i < n; ++i) out[i] = query(keys[i]);
+    }
+
+    // Sizes the result over all spanned shards first, then copies block chunks of every
+    // shard to their final offsets on one shared pool of threads.
+    std::vector<Key> rangeQuery(Key low, Key high) const {
+        if (high < low) return {};
+        return spanShards<SharedLock>(low, high, [&](size_t first, size_t last) {
+            std::vector<typename Index::RangePlan> plans;
+            std::vector<size_t> base{0};
+            struct Chunk { size_t shard, from, to; };
+            std::vector<Chunk> chunks;
+            for (size_t s = first; s <= last; ++s) {
+                plans.push_back(shards[s]->index.planRange(low, high));
+                base.push_back(base.back() + plans.back().size());
+                for (size_t j = 0; j < plans.back().blocks(); j += Index::RANGE_CHUNK_BLOCKS)
+                    chunks.push_back({s - first, j, std::min(plans.back().blocks(), j + Index::RANGE_CHUNK_BLOCKS)});
+            }
+            std::vector<Key> res(base.back());
+            unsigned threads = res.size() >= Index::PARALLEL_RANGE_KEYS ? resolveThreadCount(0) : 1;
+            runChunks(chunks.size(), threads, [&](size_t c) {
+                const Chunk& k = chunks[c];
+                shards[first + k.shard]->index.copyRange(plans[k.shard], k.from, k.to, res.data() + base[k.shard]);
+            });
+            return res;
+        });
+    }
+
+    void insert(Key x) {
+        writeShard(x, [x](Index& i) { i.insert(x); return true; });
+    }
+
+    bool erase(Key x) {
+        return writeShard(x, [x](Index& i) { return i.erase(x); });
+    }
+
+    size_t erase_range(Key low, Key high) {
+        if (high < low) return 0;
+        return spanShards<UniqueLock>(low, high, [&](size_t first, size_t last) {
+            size_t removed = 0;
+            for (size_t s = first; s <= last; ++s) {
+                removed += shards[s]->index.erase_range(low, high);
+                publishBlockCount(s);
+            }
+            return removed;
+        });
+    }
+
+    // Each shard merges its slice of the batch on its own thread.
+    void insert_bulk(const Key* keys, size_t n) {
+        if (n == 0) return;
+        std::vector<Key> batch(keys, keys + n);
+        sortKeys(batch.data(), batch.size());
+        batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+        std::vector<size_t> touched = spanShards<UniqueLock>(batch.front(), batch.back(), [&](size_t first, size_t last) {
+            std::vector<size_t> cuts{0};
+            for (size_t s = first + 1; s <= last; ++s) {
+                Key bound = shards[s]->lower.load(std::memory_order_relaxed);
+                cuts.push_back(std::lower_bound(batch.begin(), batch.end(), bound) - batch.begin());
+            }
+            cuts.push_back(batch.size());
+            runChunks(last - first + 1, resolveThreadCount(0), [&](size_t k) {
+                shards[first + k]->index.insert_bulk(batch.data() + cuts[k], cuts[k + 1] - cuts[k]);
+                publishBlockCount(first + k);
+            });
+            std::vector<size_t> spanned;
+            for (size_t s = first; s <= last; ++s) spanned.push_back(s);
+            return spanned;
+        });
+        for (size_t s : touched) balance(s);
+    }
+
+    void insert_bulk(const std::vector<Key>& keys) { insert_bulk(keys.data(), keys.size()); }
+
+    // Map mode: sets the payload of key, inserting it when absent. Returns true on insertion.
+    template <typename V = Value, EnableIfMap<V> = 0>
+    bool insert_or_assign(Key key, V value) {
+        return writeShard(key, [&](Index& i) { return i.insert_or_assign(key, std::move(value)); });
+    }
+
+    // Map mode: copies the payload of key into out. Returns false when key is absent.
+    template <typename V = Value, EnableIfMap<V> = 0>
+    bool get(Key key, V& out) const {
+        return readShard(key, [&](const Index& i) {
+            const V* v = i.find(key);
+            if (v) out = *v;
+            return v != nullptr;
+        });
+    }
+
+    // Calls f(key) (set mode) or f(key, value) (map mode) for every key in [low, high], in ascending order.
+    template <typename F>
+    void for_each_in_range(Key low, Key high, F&& f) const {
+        if (high < low) return;
+        spanShards<SharedLock>(low, high, [&](size_t first, size_t last) {
+            for (size_t s = first; s <= last; ++s) static_cast<const Index&>(shards[s]->index).for_each_in_range(low, high, f);
+            return true;
+        });
+    }
+
+    // Range aggregates from each spanned shard's cached block totals (see UltimateHybridSearch::count).
+    size_t count(Key low, Key high) const {
+        if (high < low) return 0;
+        return spanShards<SharedLock>(low, high, [&](size_t first, size_t last) {
+            size_t total = 0;
+            for (size_t s = first; s <= last; ++s) total += shards[s]->index.count(low, high);
+            return total;
+        });
+    }
+
+    typename Index::sum_type sum(Key low, Key high) const {
+        using Sum = typename Index::sum_type;
+        if (high < low) return Sum(0);
+        return spanShards<SharedLock>(low, high, [&](size_t first, size_t last) {
+            Sum total = 0;
+            for (size_t s = first; s <= last; ++s) total += shards[s]->index.sum(low, high);
+            return total;
+        });
+    }
+
+    bool rangeMin(Key low, Key high, Key& out) const {
+        if (high < low) return false;
+        return spanShards<SharedLock>(low, high, [&](size_t first, size_t last) {
+            for (size_t s = first; s <= last; ++s)
+                if (shards[s]->index.rangeMin(low, high, out)) return true;
+            return false;
+        });
+    }
+
+    bool rangeMax(Key low, Key high, Key& out) const {
+        if (high < low) return false;
+        return spanShards<SharedLock>(low, high, [&](size_t first, size_t last) {
+            for (size_t s = last + 1; s-- > first;)
+                if (shards[s]->index.rangeMax(low, high, out)) return true;
+            return false;
+        });
+    }
+
+    size_t getTotalElements() const {
+        size_t total = 0;
+        for (auto& s : shards) {
+            SharedLock lock(s->lock);
+            total += s->index.getTotalElements();
+        }
+        return total;
+    }
+
+    void printStats() const {
+        std::cout << "Shards: " << shards.size() << " | Elements: " << getTotalElements() << std::endl;
+        for (size_t s = 0; s < shards.size(); ++s) {
+            SharedLock lock(shards[s]->lock);
+            std::cout << "  [" << s << "] from ";
+            if (s == 0) std::cout << "-inf";
+            else std::cout << shards[s]->lower.load(std::memory_order_relaxed);
+            std::cout << ": ";
+            shards[s]->index.printStats();
+        }
+    }
+};
+
+// Ordered map with SERVE's search path: keys are searched densely, payloads sit in a parallel column.
+template <typename Key, typename Value>
+using ServeMap = UltimateHybridSearch<Key, Value>;
+
 #endif
@@ -0,0 +1,301 @@
+// Single-threaded regression tests for the index itself: search-path selection, the range
+// aggregates/views, the save()/open_mmap() file format and StreamingBuilder. Exits non-zero on the first failure.
+//
+//   g++ -std=c++17 -O1 -g -fsanitize=address,undefined serve_test.cpp -o serve_test -pthread
+#define SERVE_PATH_COUNTERS 1
+#include "serve.hpp"
+#include <cstdlib>
+#include <numeric>
+#include <random>
+#include <set>
+
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            std::exit(1);                                                            \
+        }                                                                            \
+    } while (0)
+
+// Lookups of every key in ref, returning how many of them took the given search path.
+template <typename Key>
+static uint64_t lookupsOnPath(const UltimateHybridSearch<Key>& s, const std::set<Key>& ref, SearchPath path) {
+    resetSearchPathCounts();
+    for (Key k : ref) CHECK(s.query(k));
+    return searchPathCount(path);
+}
+
+// An index grown from empty by single-key writes must leave the linear scan once its block
+// outgrows LINEAR_SCAN_MAX, and take it again when erases shrink the block back below it.
+template <typename Key>
+static void testSearchPaths(bool sequential) {
+    const size_t scanMax = Block<Key>::LINEAR_SCAN_MAX;
+    std::mt19937_64 rng(sequential);
+    UltimateHybridSearch<Key> s;
+    std::set<Key> ref;
+    for (size_t i = 0; ref.size() < 4000; ++i) {
+        Key k = sequential ? (Key)(i * 3) : (Key)(rng() % 1000000);
+        s.insert(k);
+        ref.insert(k);
+        if (ref.size() == scanMax) CHECK(lookupsOnPath(s, ref, SearchPath::LinearScan) == ref.size());
+    }
+    CHECK(lookupsOnPath(s, ref, SearchPath::LinearScan) == 0);
+
+    while (ref.size() > scanMax / 2) {
+        s.erase(*ref.begin());
+        ref.erase(ref.begin());
+    }
+    CHECK(lookupsOnPath(s, ref, SearchPath::LinearScan) == ref.size());
+}
+
+static void testAggregates() {
+    std::mt19937 rng(7);
+    std::vector<int> data;
+    for (int i = 0; i < 300000; ++i) data.push_back((int)(rng() % 5000000) - 2500000);
+    std::set<int> ref(data.begin(), data.end());
+    UltimateHybridSearch<int> s;
+    s.build(data);
+    for (int i = 0; i < 50000; ++i) {
+        int k = (int)(rng() % 5000000) - 2500000;
+        if (i % 2) { s.insert(k); ref.insert(k); }
+        else { s.erase(k); ref.erase(k); }
+    }
+    for (int i = 0; i < 300; ++i) {
+        int a = (int)(rng() % 5000000) - 2500000, b = a + (int)(rng() % (i % 2 ? 1000 : 3000000));
+        auto first = ref.lower_bound(a), last = ref.upper_bound(b);
+        int64_t sum = 0;
+        size_t n = 0;
+        for (auto it = first; it != last; ++it, ++n) sum += *it;
+        CHECK(s.count(a, b) == n);
+        CHECK(s.sum(a, b) == sum);
+        int lo, hi;
+        CHECK(s.rangeMin(a, b, lo) == (n > 0) && s.rangeMax(a, b, hi) == (n > 0));
+        if (n) CHECK(lo == *first && hi == *std::prev(last));
+        size_t viewed = 0;
+        for (auto slice : s.range(a, b)) viewed += slice.size();
+        CHECK(viewed == n);
+#if SERVE_HAS_SPAN
+        // The view composes with std::views adaptors by value; reversed, the last key comes first.
+        auto sizes = s.range(a, b) | std::views::transform([](auto slice) { return slice.size(); });
+        CHECK((size_t)std::accumulate(sizes.begin(), sizes.end(), size_t(0)) == n);
+        for (auto slice : s.range(a, b) | std::views::reverse | std::views::take(1)) CHECK(slice.back() == hi);
+#endif
+    }
+}
+
+#if SERVE_HAS_SPAN
+using IntRangeView = decltype(std::declval<const UltimateHybridSearch<int>&>().range(0, 0));
+static_assert(std::ranges::view<IntRangeView> && std::ranges::bidirectional_range<IntRangeView> &&
+              std::ranges::borrowed_range<IntRangeView>, "RangeView must model a borrowed bidirectional view");
+#endif
+
+// Floating-point block sums are adjusted incrementally; they must track the true total
+// through many edits, cancellation against a huge key, and an infinite key coming and going.
+static void testFloatSums() {
+    std::mt19937 rng(11);
+    auto key = [&] { return (double)(int)(rng() % 20000000 - 10000000) / 7.0; };
+    std::vector<double> data;
+    for (int i = 0; i < 200000; ++i) data.push_back(key());
+    std::set<double> ref(data.begin(), data.end());
+    UltimateHybridSearch<double> s;
+    s.build(data);
+    for (int i = 0; i < 100000; ++i) {
+        double k = key();
+        if (i % 2) { s.insert(k); ref.insert(k); }
+        else { s.erase(k); ref.erase(k); }
+    }
+    s.erase_range(-100000.0, 100000.0);
+    ref.erase(ref.lower_bound(-100000.0), ref.upper_bound(100000.0));
+    for (int i = 0; i < 100; ++i) {
+        double a = key(), b = a + std::abs(key());
+        long double exact = 0, scale = 0;
+        for (auto it = ref.lower_bound(a); it != ref.end() && *it <= b; ++it) { exact += *it; scale += std::abs(*it); }
+        CHECK(std::abs((long double)s.sum(a, b) - exact) <= 1e-12L * (scale + 1));
+    }
+
+    double before = s.sum(0.0, INFINITY);
+    s.insert(1e17);
+    s.erase(1e17);
+    CHECK(s.sum(0.0, INFINITY) == before);
+    s.insert(INFINITY);
+    CHECK(s.sum(0.0, INFINITY) == INFINITY);
+    s.erase(INFINITY);
+    CHECK(s.sum(0.0, INFINITY) == before);
+}
+
+#if SERVE_HAS_MMAP
+static std::vector<char> readFile(const std::string& path) {
+    std::vector<char> bytes;
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    CHECK(f);
+    char buf[65536];
+    for (size_t n; (n = std::fread(buf, 1, sizeof(buf), f)) > 0;) bytes.insert(bytes.end(), buf, buf + n);
+    std::fclose(f);
+    return bytes;
+}
+
+static void writeFile(const std::string& path, const std::vector<char>& bytes) {
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    CHECK(f && std::fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size());
+    std::fclose(f);
+}
+
+// open_mmap must reject path without touching the index it is called on.
+template <typename Key>
+static void checkRejected(const std::string& path) {
+    UltimateHybridSearch<Key> s;
+    std::vector<Key> keep = {1, 2, 3};
+    s.build(keep);
+    CHECK(!s.open_mmap(path));
+    CHECK(s.getTotalElements() == 3 && s.query(2));
+}
+
+// save -> open_mmap round trip, copy-on-write edits, and the crafted files open_mmap must refuse.
+static void testMmapFile() {
+    char name[] = "/tmp/serve-test-XXXXXX";
+    int fd = ::mkstemp(name);
+    CHECK(fd >= 0);
+    ::close(fd);
+    const std::string path = name, corrupt = path + ".bad";
+
+    std::mt19937 rng(13);
+    std::vector<int> data;
+    for (int i = 0; i < 100000; ++i) data.push_back((int)(rng() % 4000000) - 2000000);
+    std::set<int> ref(data.begin(), data.end());
+    UltimateHybridSearch<int> built;
+    built.build(data);
+    for (int i = 0; i < 20000; ++i) {
+        int k = (int)(rng() % 4000000) - 2000000;
+        built.erase(k);
+        ref.erase(k);
+    }
+    CHECK(built.save(path));
+    const std::vector<char> original = readFile(path);
+
+    {
+        UltimateHybridSearch<int> mapped;
+        CHECK(mapped.open_mmap(path));
+        CHECK(mapped.rangeQuery(INT32_MIN, INT32_MAX) == std::vector<int>(ref.begin(), ref.end()));
+        CHECK(mapped.sum(INT32_MIN, INT32_MAX) == built.sum(INT32_MIN, INT32_MAX));
+        // Edits copy the mapped pages they touch and never reach the file.
+        std::set<int> edited = ref;
+        for (int i = 0; i < 5000; ++i) { mapped.insert(i * 801 + 1); edited.insert(i * 801 + 1); }
+        for (int k : ref)
+            if (k % 3 == 0) { mapped.erase(k); edited.erase(k); }
+        mapped.erase_range(-1000, 1000);
+        edited.erase(edited.lower_bound(-1000), edited.upper_bound(1000));
+        CHECK(mapped.rangeQuery(INT32_MIN, INT32_MAX) == std::vector<int>(edited.begin(), edited.end()));
+    }
+    CHECK(readFile(path) == original);
+    UltimateHybridSearch<int> reopened;
+    CHECK(reopened.open_mmap(path));
+    CHECK(reopened.getTotalElements() == ref.size());
+
+    checkRejected<unsigned>(path);
+    checkRejected<int64_t>(path);
+    checkRejected<float>(path);
+
+    IndexFileHeader header;
+    std::memcpy(&header, original.data(), sizeof(header));
+    CHECK(header.blockCount > 2);
+    auto corrupted = [&](auto edit) {
+        std::vector<char> bytes = original;
+        IndexFileHeader* h = reinterpret_cast<IndexFileHeader*>(bytes.data());
+        IndexFileBlock* table = reinterpret_cast<IndexFileBlock*>(bytes.data() + header.tableOffset);
+        int* fenceKeys = reinterpret_cast<int*>(bytes.data() + header.fenceOffset);
+        edit(bytes, *h, table, fenceKeys);
+        writeFile(corrupt, bytes);
+        checkRejected<int>(corrupt);
+    };
+    using Bytes = std::vector<char>;
+    corrupted([](Bytes&, IndexFileHeader& h, IndexFileBlock*, int*) { h.magic[0] = 'X'; });
+    corrupted([](Bytes&, IndexFileHeader& h, IndexFileBlock*, int*) { ++h.version; });
+    corrupted([](Bytes& b, IndexFileHeader&, IndexFileBlock*, int*) { b.resize(sizeof(IndexFileHeader) - 1); });
+    corrupted([](Bytes& b, IndexFileHeader&, IndexFileBlock*, int*) { b.resize(b.size() / 2); });
+    corrupted([](Bytes&, IndexFileHeader& h, IndexFileBlock*, int*) { h.blockCount = UINT64_MAX / sizeof(int) + 1; });
+    corrupted([](Bytes&, IndexFileHeader& h, IndexFileBlock*, int*) { h.tableOffset = UINT64_MAX - 7; });
+    corrupted([](Bytes&, IndexFileHeader&, IndexFileBlock* t, int*) { t[1].offset = UINT64_MAX - 63; });
+    corrupted([](Bytes&, IndexFileHeader&, IndexFileBlock* t, int*) { t[1].count = UINT64_MAX / sizeof(int) + 1; });
+    corrupted([](Bytes&, IndexFileHeader&, IndexFileBlock* t, int*) { t[1].count = 0; });
+    corrupted([](Bytes&, IndexFileHeader&, IndexFileBlock*, int* f) { ++f[1]; });
+    corrupted([](Bytes&, IndexFileHeader&, IndexFileBlock* t, int*) { std::swap(t[0], t[1]); });
+    corrupted([](Bytes&, IndexFileHeader& h, IndexFileBlock*, int*) { ++h.keyCount; });
+
+    std::remove(path.c_str());
+    std::remove(corrupt.c_str());
+}
+#endif
+
+#if SERVE_HAS_MMAP
+static size_t filesIn(const std::string& dir) {
+    size_t n = 0;
+    for (auto it = std::filesystem::directory_iterator(dir); it != std::filesystem::directory_iterator(); ++it) ++n;
+    return n;
+}
+
+// Spill-and-merge over many runs in a private directory: duplicates across runs and against
+// emitted blocks collapse, spill files are gone after finish() and after an unfinished drop.
+static void testStreamingBuilder() {
+    char name[] = "/tmp/serve-runs-XXXXXX";
+    CHECK(::mkdtemp(name));
+    const std::string dir = name;
+    const size_t RUN_BYTES = 4096 * sizeof(int);
+    std::mt19937 rng(17);
+    std::set<int> ref;
+
+    UltimateHybridSearch<int> s;
+    {
+        StreamingBuilder<int> builder(s, dir, RUN_BYTES);
+        std::vector<int> sorted;
+        for (int i = 0; i < 30000; ++i) sorted.push_back(i * 7);
+        CHECK(builder.addSortedRun(sorted));
+        ref.insert(sorted.begin(), sorted.end());
+        for (int c = 0; c < 12; ++c) {
+            std::vector<int> chunk;
+            for (int i = 0; i < 3000; ++i) chunk.push_back((int)(rng() % 250000));
+            CHECK(builder.addChunk(chunk));
+            ref.insert(chunk.begin(), chunk.end());
+        }
+        CHECK(filesIn(dir) >= 5);
+        CHECK(builder.finish());
+        CHECK(filesIn(dir) == 0);
+    }
+    CHECK(s.getTotalElements() == ref.size());
+    CHECK(s.rangeQuery(INT32_MIN, INT32_MAX) == std::vector<int>(ref.begin(), ref.end()));
+    int64_t sum = 0;
+    for (auto it = ref.begin(); it != ref.upper_bound(100000); ++it) sum += *it;
+    CHECK(s.sum(0, 100000) == sum);
+
+    {
+        StreamingBuilder<int> builder(s, dir, RUN_BYTES);
+        std::vector<int> sorted = {1, 2, 3, 5, 8};
+        CHECK(builder.addSortedRun(sorted));
+        std::vector<int> chunk;
+        for (int i = 0; i < 20000; ++i) chunk.push_back((int)rng());
+        CHECK(builder.addChunk(chunk));
+        CHECK(filesIn(dir) > 0);
+    }
+    CHECK(filesIn(dir) == 0);
+    CHECK(s.getTotalElements() == 0 && !s.query(5));
+    s.insert(5);
+    s.insert(4);
+    CHECK(s.rangeQuery(0, 10) == std::vector<int>({4, 5}));
+
+    std::filesystem::remove(dir);
+}
+#endif
+
+int main() {
+    testSearchPaths<int>(false);
+    testSearchPaths<int>(true);
+    testSearchPaths<uint64_t>(false);
+    testSearchPaths<double>(true);
+    testAggregates();
+    testFloatSums();
+#if SERVE_HAS_MMAP
+    testMmapFile();
+    testStreamingBuilder();
+#endif
+    std::cout << "serve_test: ok" << std::endl;
+    return 0;
+}